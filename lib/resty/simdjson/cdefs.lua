@@ -24,7 +24,7 @@ do
             local f = io_open(fpath)
             if f ~= nil then
                 io_close(f)
-                return ffi.load(fpath)
+                return ffi.load(fpath), fpath
             end
 
             tried_paths[i] = fpath
@@ -39,10 +39,18 @@ end  -- do
 local lib_name = ffi.os == "OSX" and "libsimdjson_ffi.dylib" or "libsimdjson_ffi.so"
 
 
-local C, tried_paths = load_shared_lib(lib_name)
+local C, res = load_shared_lib(lib_name)
 if not C then
     error(("could not load %s shared library from the following paths:\n"):format(lib_name) ..
-          table.concat(tried_paths, "\n"), 2)
+          table.concat(res, "\n"), 2)
+end
+
+
+-- The Lua C API table builder lives in the same library,
+-- unless it was built without the Lua headers
+local luaopen_capi = package.loadlib(res, "luaopen_resty_simdjson_capi")
+if luaopen_capi then
+    package.preload["resty.simdjson.capi"] = luaopen_capi
 end
 
 
@@ -54,7 +62,12 @@ typedef enum {
     SIMDJSON_FFI_OPCODE_STRING,
     SIMDJSON_FFI_OPCODE_BOOLEAN,
     SIMDJSON_FFI_OPCODE_NULL,
-    SIMDJSON_FFI_OPCODE_RETURN
+    SIMDJSON_FFI_OPCODE_RETURN,
+    SIMDJSON_FFI_OPCODE_ERROR,
+    SIMDJSON_FFI_OPCODE_INT64,
+    SIMDJSON_FFI_OPCODE_UINT64,
+    SIMDJSON_FFI_OPCODE_KEY,
+    SIMDJSON_FFI_OPCODE_KEY_ID
 } simdjson_ffi_opcode_e;
 
 typedef struct {
@@ -64,18 +77,122 @@ typedef struct {
     union {
         const char            *str;
         double                 number;
+        int64_t                i64;
+        uint64_t               u64;
         uint32_t               boolean;
     }                          val;
 } simdjson_ffi_op_t;
 
+typedef union {
+    double                     number;
+    int64_t                    i64;
+    uint64_t                   u64;
+    uint32_t                   boolean;
+    uint32_t                   size;
+    struct {
+        uint32_t               offset;
+        uint32_t               len;
+    }                          str;
+} simdjson_ffi_payload_t;
+
+typedef struct {
+    const uint8_t                 *opcodes;
+    const simdjson_ffi_payload_t  *payloads;
+    const char                    *strings;
+} simdjson_ffi_ops_t;
+
+typedef struct {
+    const uint64_t                *words;
+    const char                    *strings;
+} simdjson_ffi_tape_t;
+
+typedef struct {
+    size_t                        max_document_size;
+    size_t                        max_elements;
+    size_t                        max_values;
+    size_t                        max_string_length;
+} simdjson_ffi_limits_t;
+
+typedef struct {
+    size_t                        capacity;
+    size_t                        string_buf;
+    size_t                        ops;
+    size_t                        copy;
+    size_t                        dom_capacity;
+    size_t                        body;
+} simdjson_ffi_memory_t;
+
+enum {
+    SIMDJSON_FFI_BATCH_SIZE = 2048,
+    SIMDJSON_FFI_MIN_BATCH_SIZE = 2,
+    SIMDJSON_FFI_MAX_BATCH_SIZE = 1048576,
+    SIMDJSON_FFI_MAX_DEPTH = 1024,
+    SIMDJSON_FFI_MAX_DEPTH_LIMIT = 65536,
+    SIMDJSON_FFI_NUMBER_BUF_SIZE = 32,
+    SIMDJSON_FFI_OPCODES = 12,
+    SIMDJSON_FFI_ERROR_CODES = 64
+};
+
+typedef struct {
+    uint64_t                      documents;
+    uint64_t                      bytes;
+    uint64_t                      copied;
+    uint64_t                      batches;
+    uint64_t                      ops[SIMDJSON_FFI_OPCODES];
+    uint64_t                      errors[SIMDJSON_FFI_ERROR_CODES];
+    uint64_t                      limits;
+    uint64_t                      max_depth;
+} simdjson_ffi_stats_t;
+
 typedef struct simdjson_ffi_state_t simdjson_ffi_state;
+typedef struct simdjson_ffi_encoder_state_t simdjson_ffi_encoder_state;
 
-simdjson_ffi_state *simdjson_ffi_state_new();
-simdjson_ffi_op_t *simdjson_ffi_state_get_ops(simdjson_ffi_state *state);
+simdjson_ffi_state *simdjson_ffi_state_new(size_t batch_size, size_t max_depth);
+const simdjson_ffi_ops_t *simdjson_ffi_state_get_ops(simdjson_ffi_state *state);
 void simdjson_ffi_state_free(simdjson_ffi_state *state);
+void simdjson_ffi_state_set_int64(simdjson_ffi_state *state, int enable);
+void simdjson_ffi_state_set_batch_bytes(simdjson_ffi_state *state, size_t bytes);
+void simdjson_ffi_state_set_shrink(simdjson_ffi_state *state, size_t factor, size_t baseline);
+void simdjson_ffi_state_set_limits(simdjson_ffi_state *state, const simdjson_ffi_limits_t *limits);
+void simdjson_ffi_state_memory(simdjson_ffi_state *state, simdjson_ffi_memory_t *memory);
+void simdjson_ffi_state_stats(simdjson_ffi_state *state, simdjson_ffi_stats_t *stats);
+const char *simdjson_ffi_error_message(int code);
+int simdjson_ffi_state_set_projection(simdjson_ffi_state *state, const char **paths,
+                                      const size_t *lens, size_t n, char **errmsg);
 int simdjson_ffi_is_eof(simdjson_ffi_state *state);
 int simdjson_ffi_parse(simdjson_ffi_state *state, const char *json, size_t len, char **errmsg);
+int simdjson_ffi_parse_padded(simdjson_ffi_state *state, const char *json, size_t len,
+                              char **errmsg);
 int simdjson_ffi_next(simdjson_ffi_state *state, char **errmsg);
+int simdjson_ffi_append(simdjson_ffi_state *state, const char *chunk, size_t len, char **errmsg);
+int simdjson_ffi_parse_body(simdjson_ffi_state *state, char **errmsg);
+void simdjson_ffi_discard_body(simdjson_ffi_state *state);
+int simdjson_ffi_parse_many(simdjson_ffi_state *state, const char *json, size_t len, char **errmsg);
+int simdjson_ffi_next_document(simdjson_ffi_state *state, char **errmsg);
+int simdjson_ffi_parse_batch(simdjson_ffi_state *state, const char **jsons, const size_t *lens,
+                             size_t n, const simdjson_ffi_ops_t **ops, char **errmsg);
+int simdjson_ffi_parse_tape(simdjson_ffi_state *state, const char *json, size_t len,
+                            const simdjson_ffi_tape_t **tape, char **errmsg);
+int simdjson_ffi_validate(simdjson_ffi_state *state, const char *json, size_t len, char **errmsg);
+int simdjson_ffi_at_pointer(simdjson_ffi_state *state, const char *json, size_t len,
+                            const char *pointer, size_t pointer_len, char **errmsg);
+
+size_t simdjson_ffi_escape_string(const char *str, size_t len, char *out);
+int simdjson_ffi_format_number(double number, int precision, char *out);
+int simdjson_ffi_format_int64(int64_t number, char *out);
+int simdjson_ffi_format_uint64(uint64_t number, char *out);
+
+int simdjson_ffi_minify(const char *json, size_t len, char *out, size_t *out_len, char **errmsg);
+int simdjson_ffi_validate_utf8(const char *str, size_t len);
+double simdjson_ffi_clock();
+
+simdjson_ffi_encoder_state *simdjson_ffi_encoder_state_new();
+simdjson_ffi_op_t *simdjson_ffi_encoder_state_get_ops(simdjson_ffi_encoder_state *state);
+void simdjson_ffi_encoder_state_set_precision(simdjson_ffi_encoder_state *state, int precision);
+void simdjson_ffi_encoder_state_reset(simdjson_ffi_encoder_state *state);
+void simdjson_ffi_encoder_state_free(simdjson_ffi_encoder_state *state);
+int simdjson_ffi_encode(simdjson_ffi_encoder_state *state, size_t n, char **errmsg);
+const char *simdjson_ffi_encode_finish(simdjson_ffi_encoder_state *state, size_t *len, char **errmsg);
 ]])
 
 
@@ -5,16 +5,26 @@ local _MT = { __index = _M, }
 local ffi = require("ffi")
 local table_new = require("table.new")
 local C = require("resty.simdjson.cdefs")
+-- nil if the library was built without the Lua C API table builder
+local capi = package.preload["resty.simdjson.capi"] and require("resty.simdjson.capi")
 
 
 local type = type
 local assert = assert
 local error = error
 local setmetatable = setmetatable
+local pairs = pairs
+local tonumber = tonumber
+local math_huge = math.huge
 local ffi_string = ffi.string
 local ffi_gc = ffi.gc
+local ffi_new = ffi.new
+local ffi_cast = ffi.cast
+local capi_decode = capi and capi.decode
 local ngx_null = ngx.null
 local ngx_sleep = ngx.sleep
+local band = bit.band
+local rshift = bit.rshift
 
 
 local SIMDJSON_FFI_OPCODE_ARRAY = C.SIMDJSON_FFI_OPCODE_ARRAY
@@ -24,33 +34,164 @@ local SIMDJSON_FFI_OPCODE_STRING = C.SIMDJSON_FFI_OPCODE_STRING
 local SIMDJSON_FFI_OPCODE_BOOLEAN = C.SIMDJSON_FFI_OPCODE_BOOLEAN
 local SIMDJSON_FFI_OPCODE_NULL = C.SIMDJSON_FFI_OPCODE_NULL
 local SIMDJSON_FFI_OPCODE_RETURN = C.SIMDJSON_FFI_OPCODE_RETURN
+local SIMDJSON_FFI_OPCODE_ERROR = C.SIMDJSON_FFI_OPCODE_ERROR
+local SIMDJSON_FFI_OPCODE_INT64 = C.SIMDJSON_FFI_OPCODE_INT64
+local SIMDJSON_FFI_OPCODE_UINT64 = C.SIMDJSON_FFI_OPCODE_UINT64
+local SIMDJSON_FFI_OPCODE_KEY = C.SIMDJSON_FFI_OPCODE_KEY
+local SIMDJSON_FFI_OPCODE_KEY_ID = C.SIMDJSON_FFI_OPCODE_KEY_ID
 local SIMDJSON_FFI_ERROR = -1
+local SIMDJSON_FFI_MIN_BATCH_SIZE = C.SIMDJSON_FFI_MIN_BATCH_SIZE
+local SIMDJSON_FFI_MAX_BATCH_SIZE = C.SIMDJSON_FFI_MAX_BATCH_SIZE
+local SIMDJSON_FFI_MAX_DEPTH_LIMIT = C.SIMDJSON_FFI_MAX_DEPTH_LIMIT
+local SIMDJSON_FFI_ERROR_CODES = C.SIMDJSON_FFI_ERROR_CODES
+local DEFAULT_SHRINK_BASELINE = 64 * 1024
+-- one second, in microseconds
+local MAX_YIELD_BUDGET = 1000000
+-- largest document simdjson can parse, `SIMDJSON_MAXSIZE_BYTES`
+local MAX_SIZE = 0xFFFFFFFF
+-- `engine = "auto"` decodes documents up to this size with the DOM engine,
+-- which is faster at any size but takes ~14 bytes of memory per input byte
+local TAPE_MAX_SIZE = 256 * 1024
+-- fields of `simdjson_ffi_limits_t`, named after the options of `simdjson.new()`
+local LIMITS = { "max_document_size", "max_elements", "max_values", "max_string_length", }
 
 
-local DEFAULT_TABLE_SLOTS = 4
 local errmsg = require("resty.core.base").get_errmsg_ptr()
+local batch_ops = ffi_new("const simdjson_ffi_ops_t *[1]")
+local memory = ffi_new("simdjson_ffi_memory_t")
+local stats = ffi_new("simdjson_ffi_stats_t")
+local tape_ptr = ffi_new("const simdjson_ffi_tape_t *[1]")
+local char_ptr_t = ffi.typeof("const char *")
+-- grown on demand, shared by all the parsers
+local batch_jsons
+local batch_lens
+local batch_size = 0
+
+
+-- Called between two batches. Yields every time, unless there is a
+-- yield budget, in which case only once it is used up.
+local function yielding(self)
+    if not self.yieldable then
+        return
+    end
+
+    local budget = self.yield_budget
+
+    if budget and C.simdjson_ffi_clock() - self.yielded_at < budget then
+        return
+    end
+
+    ngx_sleep(0)
+
+    self.yields = self.yields + 1
+
+    if budget then
+        self.yielded_at = C.simdjson_ffi_clock()
+    end
+end
 
 
-local function yielding(enable)
-    if enable then
-        ngx_sleep(0)
+local function check_integer(opts, name, min, max)
+    local value = opts[name]
+
+    if value ~= nil then
+        assert(type(value) == "number" and value % 1 == 0 and value >= min and value <= max,
+               name .. " must be an integer between " .. min .. " and " .. max)
     end
+
+    return value
 end
 
 
-function _M.new(yieldable)
-    local state = C.simdjson_ffi_state_new()
+-- `opts` is the table passed to `simdjson.new()`, if any
+function _M.new(yieldable, opts)
+    opts = opts or {}
+
+    local batch_size = check_integer(opts, "batch_size", SIMDJSON_FFI_MIN_BATCH_SIZE,
+                                     SIMDJSON_FFI_MAX_BATCH_SIZE)
+    local max_depth = check_integer(opts, "max_depth", 1, SIMDJSON_FFI_MAX_DEPTH_LIMIT)
+    local shrink_factor = check_integer(opts, "shrink_factor", 0, 1024)
+    local shrink_baseline = check_integer(opts, "shrink_baseline", 0, MAX_SIZE)
+    local batch_bytes = check_integer(opts, "batch_bytes", 1, MAX_SIZE)
+    local yield_budget = check_integer(opts, "yield_budget", 1, MAX_YIELD_BUDGET)
+    local engine = opts.engine or "ondemand"
+    local tape_max_size
+    local use_capi = false
+
+    if engine == "dom" then
+        assert(not yieldable, "the dom engine can not yield")
+        tape_max_size = math_huge
+
+    elseif engine == "auto" then
+        -- yieldable decodes always go through ondemand
+        tape_max_size = not yieldable and TAPE_MAX_SIZE or nil
+        -- larger documents are built with the Lua C API if it is there
+        use_capi = not yieldable and capi ~= nil
+
+    elseif engine == "capi" then
+        assert(not yieldable, "the capi engine can not yield")
+        assert(capi, "the capi engine is not built in")
+        use_capi = true
+
+    else
+        assert(engine == "ondemand",
+               "engine must be one of \"ondemand\", \"dom\", \"capi\" or \"auto\"")
+    end
+
+    local limits
+
+    for i = 1, #LIMITS do
+        local name = LIMITS[i]
+        local limit = check_integer(opts, name, 1, MAX_SIZE)
+
+        if limit then
+            limits = limits or ffi_new("simdjson_ffi_limits_t")
+            limits[name] = limit
+        end
+    end
+
+    -- 0 picks the default batch size and max depth
+    local state = C.simdjson_ffi_state_new(batch_size or 0, max_depth or 0)
     if state == nil then
         return nil, "no memory"
     end
 
+    if opts.int64 then
+        C.simdjson_ffi_state_set_int64(state, 1)
+    end
+
+    if batch_bytes then
+        C.simdjson_ffi_state_set_batch_bytes(state, batch_bytes)
+    end
+
+    if shrink_factor then
+        C.simdjson_ffi_state_set_shrink(state, shrink_factor,
+                                        shrink_baseline or DEFAULT_SHRINK_BASELINE)
+    end
+
+    if limits then
+        C.simdjson_ffi_state_set_limits(state, limits)
+    end
+
     local self = {
         ops_index = 0,
         ops_size = 0,
         state = ffi_gc(state, C.simdjson_ffi_state_free),
         ops = nil,  -- reserved for decode
         yieldable = yieldable,
+        yield_budget = yield_budget,  -- in microseconds, nil to yield every batch
+        yielded_at = 0,
+        tape_max_size = tape_max_size,  -- nil if the DOM engine is never used
+        capi = use_capi,  -- decode with the capi engine, passing it `state`
+        int64 = opts.int64 and true or false,
         decoding = false,
+        projection = nil,
+        generation = 0, -- bumped by every decode, invalidates process_many iterators
+        keys = {},  -- object keys of the current document, by id
+        keys_n = 0,
+        -- stats only the Lua side knows about, see `stats()`
+        yields = 0,
+        trailing = 0,
     }
 
     return setmetatable(self, _MT)
@@ -74,27 +215,129 @@ function _M:destroy()
 end
 
 
-function _M:_build(op)
-    local opcode = op.opcode
+function _M:memory()
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    C.simdjson_ffi_state_memory(state, memory)
 
+    return {
+        capacity = tonumber(memory.capacity),
+        string_buf = tonumber(memory.string_buf),
+        ops = tonumber(memory.ops),
+        copy = tonumber(memory.copy),
+        dom_capacity = tonumber(memory.dom_capacity),
+        body = tonumber(memory.body),
+    }
+end
+
+
+local OPCODE_NAMES = {
+    [SIMDJSON_FFI_OPCODE_ARRAY] = "array",
+    [SIMDJSON_FFI_OPCODE_OBJECT] = "object",
+    [SIMDJSON_FFI_OPCODE_NUMBER] = "number",
+    [SIMDJSON_FFI_OPCODE_STRING] = "string",
+    [SIMDJSON_FFI_OPCODE_BOOLEAN] = "boolean",
+    [SIMDJSON_FFI_OPCODE_NULL] = "null",
+    [SIMDJSON_FFI_OPCODE_RETURN] = "return",
+    [SIMDJSON_FFI_OPCODE_ERROR] = "error",
+    [SIMDJSON_FFI_OPCODE_INT64] = "int64",
+    [SIMDJSON_FFI_OPCODE_UINT64] = "uint64",
+    [SIMDJSON_FFI_OPCODE_KEY] = "key",
+    [SIMDJSON_FFI_OPCODE_KEY_ID] = "key_id",
+}
+-- filled in on demand, e.g. "TAPE_ERROR" for `simdjson::TAPE_ERROR`
+local ERROR_NAMES = {}
+
+
+-- `encoder_yields` are those of the encoder of the same parser
+function _M:stats(encoder_yields)
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    C.simdjson_ffi_state_stats(state, stats)
+
+    local ops = {}
+
+    for opcode, name in pairs(OPCODE_NAMES) do
+        ops[name] = tonumber(stats.ops[opcode])
+    end
+
+    -- only the errors which happened, by name
+    local errors = {}
+
+    for code = 1, SIMDJSON_FFI_ERROR_CODES - 1 do
+        local n = tonumber(stats.errors[code])
+
+        if n > 0 then
+            local name = ERROR_NAMES[code]
+
+            if not name then
+                name = ffi_string(C.simdjson_ffi_error_message(code)):match("^[%w_]+")
+                ERROR_NAMES[code] = name
+            end
+
+            errors[name] = n
+        end
+    end
+
+    local limits = tonumber(stats.limits)
+    if limits > 0 then
+        errors.LIMIT_EXCEEDED = limits
+    end
+
+    -- found by `_decode_all()` rather than simdjson
+    if self.trailing > 0 then
+        errors.TRAILING_CONTENT = (errors.TRAILING_CONTENT or 0) + self.trailing
+    end
+
+    return {
+        documents = tonumber(stats.documents),
+        bytes = tonumber(stats.bytes),
+        copied = tonumber(stats.copied),
+        batches = tonumber(stats.batches),
+        ops = ops,
+        yields = self.yields + (encoder_yields or 0),
+        errors = errors,
+        max_depth = tonumber(stats.max_depth),
+    }
+end
+
+
+function _M:_build(opcode, payload)
+    -- `size` of containers is the number of elements or fields,
+    -- or an upper bound of it
     if opcode == SIMDJSON_FFI_OPCODE_ARRAY then
-        return self:_build_array(DEFAULT_TABLE_SLOTS)
+        return self:_build_array(payload.size)
 
     elseif opcode == SIMDJSON_FFI_OPCODE_OBJECT then
-        return self:_build_object(DEFAULT_TABLE_SLOTS)
+        return self:_build_object(payload.size)
 
     elseif opcode == SIMDJSON_FFI_OPCODE_NUMBER then
-        return op.val.number
+        return payload.number
 
     elseif opcode == SIMDJSON_FFI_OPCODE_STRING then
-        return ffi_string(op.val.str, op.size)
+        local str = payload.str
+        return ffi_string(self.ops.strings + str.offset, str.len)
 
     elseif opcode == SIMDJSON_FFI_OPCODE_BOOLEAN then
-        return op.val.boolean == 1
+        return payload.boolean == 1
 
     elseif opcode == SIMDJSON_FFI_OPCODE_NULL then
         return ngx_null
 
+    elseif opcode == SIMDJSON_FFI_OPCODE_INT64 then
+        return payload.i64
+
+    elseif opcode == SIMDJSON_FFI_OPCODE_UINT64 then
+        return payload.u64
+
     else
         assert(false) -- never reach here
     end
@@ -112,13 +355,11 @@ function _M:_build_array(count)
     local n = 1
     local tbl = table_new(count, 0)
     local ops = self.ops
-    local yieldable = self.yieldable
 
     repeat
         while self.ops_index < self.ops_size do
             local ops_index = self.ops_index
-            local op = ops[ops_index]
-            local opcode = op.opcode
+            local opcode = ops.opcodes[ops_index]
 
             self.ops_index = ops_index + 1
 
@@ -126,7 +367,7 @@ function _M:_build_array(count)
                 return tbl
             end
 
-            tbl[n], err = self:_build(op)
+            tbl[n], err = self:_build(opcode, ops.payloads[ops_index])
             if err then
               return nil, err
             end
@@ -134,7 +375,7 @@ function _M:_build_array(count)
             n = n + 1
         end
 
-        yielding(yieldable)
+        yielding(self)
 
         self.ops_size = C.simdjson_ffi_next(state, errmsg)
         if self.ops_size == SIMDJSON_FFI_ERROR then
@@ -159,13 +400,11 @@ function _M:_build_object(count)
     local tbl = table_new(0, count)
     local key
     local ops = self.ops
-    local yieldable = self.yieldable
 
     repeat
         while self.ops_index < self.ops_size do
             local ops_index = self.ops_index
-            local op = ops[ops_index]
-            local opcode = op.opcode
+            local opcode = ops.opcodes[ops_index]
 
             self.ops_index = ops_index + 1
 
@@ -176,13 +415,30 @@ function _M:_build_object(count)
             end
 
             if not key then
-                -- object key must be string
-                assert(opcode == SIMDJSON_FFI_OPCODE_STRING)
-                key = ffi_string(op.val.str, op.size)
+                if opcode == SIMDJSON_FFI_OPCODE_KEY_ID then
+                    -- seen before in this document
+                    key = self.keys[ops.payloads[ops_index].size]
+
+                elseif opcode == SIMDJSON_FFI_OPCODE_KEY then
+                    -- first occurrence, remembered under the next id
+                    local str = ops.payloads[ops_index].str
+                    key = ffi_string(ops.strings + str.offset, str.len)
+
+                    local keys_n = self.keys_n + 1
+                    self.keys[keys_n] = key
+                    self.keys_n = keys_n
+
+                else
+                    -- object key must be string
+                    assert(opcode == SIMDJSON_FFI_OPCODE_STRING)
+
+                    local str = ops.payloads[ops_index].str
+                    key = ffi_string(ops.strings + str.offset, str.len)
+                end
 
             else
                 -- value
-                tbl[key], err = self:_build(op)
+                tbl[key], err = self:_build(opcode, ops.payloads[ops_index])
                 if err then
                   return nil, err
                 end
@@ -191,7 +447,7 @@ function _M:_build_object(count)
             end
         end
 
-        yielding(yieldable)
+        yielding(self)
 
         self.ops_size = C.simdjson_ffi_next(state, errmsg)
         if self.ops_size == SIMDJSON_FFI_ERROR then
@@ -205,8 +461,213 @@ function _M:_build_object(count)
 end
 
 
-function _M:process(json)
+function _M:_decode(res)
+    if res == SIMDJSON_FFI_ERROR then
+        self.decoding = false
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    local ops = self.ops
+
+    -- key ids start over with every document
+    self.keys_n = 0
+
+    if self.yield_budget then
+        self.yielded_at = C.simdjson_ffi_clock()
+    end
+
+    local res, err = self:_build(ops.opcodes[0], ops.payloads[0])
+
+    self.decoding = false
+
+    if err then
+        return nil, err
+    end
+
+    return res
+end
+
+
+local build_tape
+do
+    local TAPE_STRING = string.byte('"')
+    local TAPE_INT64 = string.byte("l")
+    local TAPE_UINT64 = string.byte("u")
+    local TAPE_DOUBLE = string.byte("d")
+    local TAPE_TRUE = string.byte("t")
+    local TAPE_FALSE = string.byte("f")
+    local TAPE_NULL = string.byte("n")
+    local TAPE_START_ARRAY = string.byte("[")
+    local TAPE_START_OBJECT = string.byte("{")
+
+    local MAX_SAFE_INTEGER = 2^53
+
+    local uint32_ptr_t = ffi.typeof("const uint32_t *")
+    local int32_ptr_t = ffi.typeof("const int32_t *")
+    local int64_ptr_t = ffi.typeof("const int64_t *")
+    local uint64_ptr_t = ffi.typeof("const uint64_t *")
+    local double_ptr_t = ffi.typeof("const double *")
+
+    -- views of the tape being built, words are read as two 32 bit halves
+    -- (little endian) to keep 64 bit cdata off the common paths
+    local words, iwords, i64s, u64s, doubles, strings, int64
+
+    local build
+
+    -- Builds the value at `tape[i]`, returns it along with
+    -- the index of the next value.
+    build = function(i)
+        local lo = words[2 * i]
+        local hi = words[2 * i + 1]
+        local typ = rshift(hi, 24)
+
+        if typ == TAPE_STRING then
+            local offset = lo + band(hi, 0xffffff) * 4294967296
+            return ffi_string(strings + offset + 4, ffi_cast(uint32_ptr_t, strings + offset)[0]),
+                   i + 1
+
+        elseif typ == TAPE_DOUBLE then
+            return doubles[i + 1], i + 2
+
+        elseif typ == TAPE_INT64 then
+            local vhi = iwords[2 * i + 3]
+
+            -- |v| < 2^53 exactly when the high half is within 21 bits
+            if vhi < 2097152 and vhi >= -2097152 then
+                return vhi * 4294967296 + words[2 * i + 2], i + 2
+            end
+
+            local v = i64s[i + 1]
+            if int64 and (v > MAX_SAFE_INTEGER or v < -MAX_SAFE_INTEGER) then
+                return v, i + 2
+            end
+
+            return tonumber(v), i + 2
+
+        elseif typ == TAPE_UINT64 then
+            -- always beyond INT64_MAX
+            local v = u64s[i + 1]
+            return int64 and v or tonumber(v), i + 2
+
+        elseif typ == TAPE_START_ARRAY then
+            -- `lo` points after the closing word, the count saturates
+            -- at 2^24 - 1, beyond which it is only a hint
+            local tbl = table_new(band(hi, 0xffffff), 0)
+            local close = lo - 1
+            local n = 0
+            local v
+
+            i = i + 1
+
+            while i < close do
+                v, i = build(i)
+                n = n + 1
+                tbl[n] = v
+            end
+
+            return tbl, lo
+
+        elseif typ == TAPE_START_OBJECT then
+            local tbl = table_new(0, band(hi, 0xffffff))
+            local close = lo - 1
+            local k, v
+
+            i = i + 1
+
+            while i < close do
+                k, i = build(i)
+                v, i = build(i)
+                tbl[k] = v
+            end
+
+            return tbl, lo
+
+        elseif typ == TAPE_TRUE then
+            return true, i + 1
+
+        elseif typ == TAPE_FALSE then
+            return false, i + 1
+
+        elseif typ == TAPE_NULL then
+            return ngx_null, i + 1
+        end
+
+        assert(false) -- never reach here
+    end
+
+    function build_tape(tape, enable_int64)
+        local ptr = tape.words
+
+        words = ffi_cast(uint32_ptr_t, ptr)
+        iwords = ffi_cast(int32_ptr_t, ptr)
+        i64s = ffi_cast(int64_ptr_t, ptr)
+        u64s = ffi_cast(uint64_ptr_t, ptr)
+        doubles = ffi_cast(double_ptr_t, ptr)
+        strings = tape.strings
+        int64 = enable_int64
+
+        -- the root word comes first
+        local res = build(1)
+
+        words, iwords, i64s, u64s, doubles, strings = nil, nil, nil, nil, nil, nil
+
+        return res
+    end
+end
+
+
+-- Decodes `json` with the DOM engine, `json` is validated as a whole
+-- before any Lua object is created. Returns nothing for documents the DOM
+-- engine leaves to the others, see `simdjson_ffi_parse_tape()`.
+function _M:_process_tape(json, len)
+    self.generation = self.generation + 1
+
+    local words = C.simdjson_ffi_parse_tape(self.state, json, len, tape_ptr, errmsg)
+    if words == SIMDJSON_FFI_ERROR then
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    if words == 0 then
+        -- nothing returned, left to the other engines
+        return nil
+    end
+
+    local res = build_tape(tape_ptr[0], self.int64)
+
+    -- not a tail call, the tape belongs to `self.state`, which must not be
+    -- collected with a temporary parser until the last table is built
+    return res
+end
+
+
+function _M:_set_projection(projection)
+    local n = projection and #projection or 0
+    local paths = ffi_new("const char *[?]", n)
+    local lens = ffi_new("size_t[?]", n)
+
+    for i = 1, n do
+        local path = projection[i]
+        assert(type(path) == "string", "projection path must be a string")
+
+        paths[i - 1] = path
+        lens[i - 1] = #path
+    end
+
+    -- the C side copies the paths, no need to anchor them
+    if C.simdjson_ffi_state_set_projection(self.state, paths, lens, n, errmsg) == SIMDJSON_FFI_ERROR then
+        self.projection = nil
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    self.projection = projection
+
+    return true
+end
+
+
+function _M:process(json, projection)
     assert(type(json) == "string")
+    assert(projection == nil or type(projection) == "table")
 
     local state = self.state
 
@@ -218,28 +679,62 @@ function _M:process(json)
         error("decode is not reentrant", 2)
     end
 
+    -- the projection table is cached by identity,
+    -- do not modify it after being passed in
+    if projection ~= self.projection then
+        local ok, err = self:_set_projection(projection)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    local tape_max_size = self.tape_max_size
+    if tape_max_size and not projection and #json <= tape_max_size then
+        local res, err = self:_process_tape(json, #json)
+
+        -- not a tail call, see `_process_tape()`
+        if res ~= nil or err then
+            return res, err
+        end
+    end
+
+    if self.capi and not projection then
+        self.generation = self.generation + 1
+
+        local res, err = capi_decode(state, json, ngx_null)
+        if err then
+            return nil, "simdjson: error: " .. err
+        end
+
+        if res ~= nil then
+            return res
+        end
+
+        -- nothing returned, int64 cdata can only be created through the FFI
+    end
+
     -- allocate array memory on-demond
     self.ops = assert(C.simdjson_ffi_state_get_ops(state))
 
     self.decoding = true
+    self.generation = self.generation + 1
 
-    local res = C.simdjson_ffi_parse(state, json, #json, errmsg)
-    if res == SIMDJSON_FFI_ERROR then
-        self.decoding = false
-        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
-    end
-
-    local op = self.ops[0]
+    local res, err = self:_decode_all(C.simdjson_ffi_parse(state, json, #json, errmsg))
 
-    local res, err = self:_build(op)
+    -- not a tail call, the C side points into `json` until the last batch
+    return res, err
+end
 
-    self.decoding = false
 
+-- Like `_decode()`, for documents which must span all of the input.
+function _M:_decode_all(ops_n)
+    local res, err = self:_decode(ops_n)
     if err then
         return nil, err
     end
 
-    if res and res ~= ngx_null and C.simdjson_ffi_is_eof(state) ~= 1 then
+    if res and res ~= ngx_null and C.simdjson_ffi_is_eof(self.state) ~= 1 then
+        self.trailing = self.trailing + 1
         return nil, "simdjson: error: trailing content found"
     end
 
@@ -247,4 +742,337 @@ function _M:process(json)
 end
 
 
+-- Like `process()`, for `len` bytes of C memory at `ptr`, which must stay
+-- valid until the call returns. If `padded` is true, `SIMDJSON_PADDING`
+-- bytes after them must be readable, and the input is never copied.
+function _M:process_ptr(ptr, len, padded, projection)
+    assert(type(ptr) == "cdata" and ptr ~= nil)
+    assert(type(len) == "number" and len % 1 == 0 and len >= 0)
+    assert(projection == nil or type(projection) == "table")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    if projection ~= self.projection then
+        local ok, err = self:_set_projection(projection)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    local json = ffi_cast(char_ptr_t, ptr)
+
+    -- the capi engine takes Lua strings only
+    local tape_max_size = self.tape_max_size
+    if tape_max_size and not projection and len <= tape_max_size then
+        local res, err = self:_process_tape(json, len)
+
+        -- not a tail call, see `_process_tape()`
+        if res ~= nil or err then
+            return res, err
+        end
+    end
+
+    -- allocate array memory on-demond
+    self.ops = assert(C.simdjson_ffi_state_get_ops(state))
+
+    self.decoding = true
+    self.generation = self.generation + 1
+
+    if padded then
+        return self:_decode_all(C.simdjson_ffi_parse_padded(state, json, len, errmsg))
+    end
+
+    return self:_decode_all(C.simdjson_ffi_parse(state, json, len, errmsg))
+end
+
+
+function _M:append(chunk)
+    assert(type(chunk) == "string")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    -- the body being decoded might still be read
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    if C.simdjson_ffi_append(state, chunk, #chunk, errmsg) == SIMDJSON_FFI_ERROR then
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    return true
+end
+
+
+function _M:discard()
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    C.simdjson_ffi_discard_body(state)
+end
+
+
+-- Decodes the chunks passed to `append()` so far, always with ondemand.
+function _M:process_body(projection)
+    assert(projection == nil or type(projection) == "table")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    if projection ~= self.projection then
+        local ok, err = self:_set_projection(projection)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    -- allocate array memory on-demond
+    self.ops = assert(C.simdjson_ffi_state_get_ops(state))
+
+    self.decoding = true
+    self.generation = self.generation + 1
+
+    return self:_decode_all(C.simdjson_ffi_parse_body(state, errmsg))
+end
+
+
+function _M:validate(json)
+    assert(type(json) == "string")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    -- the padded copy of a suspended decode might be replaced
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    -- invalidates `process_many()` iterators, like every other decode
+    self.generation = self.generation + 1
+
+    if C.simdjson_ffi_validate(state, json, #json, errmsg) == SIMDJSON_FFI_ERROR then
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    return true
+end
+
+
+function _M:at_pointer(json, pointer)
+    assert(type(json) == "string")
+    assert(type(pointer) == "string")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    -- allocate array memory on-demond
+    self.ops = assert(C.simdjson_ffi_state_get_ops(state))
+
+    self.decoding = true
+    self.generation = self.generation + 1
+
+    local res = C.simdjson_ffi_at_pointer(state, json, #json, pointer, #pointer, errmsg)
+    if res == 0 then
+        -- no such value
+        self.decoding = false
+        return nil
+    end
+
+    local obj, err = self:_decode(res)
+
+    -- not a tail call, the C side points into `json` until the last batch
+    return obj, err
+end
+
+
+function _M:process_many(json, projection)
+    assert(type(json) == "string")
+    assert(projection == nil or type(projection) == "table")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    if projection ~= self.projection then
+        local ok, err = self:_set_projection(projection)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    -- allocate array memory on-demond
+    self.ops = assert(C.simdjson_ffi_state_get_ops(state))
+
+    self.generation = self.generation + 1
+
+    if C.simdjson_ffi_parse_many(state, json, #json, errmsg) == SIMDJSON_FFI_ERROR then
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    local generation = self.generation
+    local n = 0
+
+    return function()
+        if not json then
+            return nil
+        end
+
+        if generation ~= self.generation then
+            error("parser was used by another decode during iteration", 2)
+        end
+
+        local state = self.state
+
+        if not state then
+            error("already destroyed", 2)
+        end
+
+        if self.yieldable and self.decoding then
+            error("decode is not reentrant", 2)
+        end
+
+        self.decoding = true
+
+        local res = C.simdjson_ffi_next_document(state, errmsg)
+        if res == 0 then
+            -- the C side might still point into it until here
+            json = nil
+            self.decoding = false
+            return nil
+        end
+
+        n = n + 1
+
+        return n, self:_decode(res)
+    end
+end
+
+
+function _M:process_batch(jsons, projection)
+    assert(type(jsons) == "table")
+    assert(projection == nil or type(projection) == "table")
+
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.yieldable and self.decoding then
+        error("decode is not reentrant", 2)
+    end
+
+    if projection ~= self.projection then
+        local ok, err = self:_set_projection(projection)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    local n = #jsons
+
+    if n > batch_size then
+        batch_size = n
+        batch_jsons = ffi_new("const char *[?]", n)
+        batch_lens = ffi_new("size_t[?]", n)
+    end
+
+    for i = 1, n do
+        local json = jsons[i]
+        assert(type(json) == "string")
+
+        batch_jsons[i - 1] = json
+        batch_lens[i - 1] = #json
+    end
+
+    self.decoding = true
+    self.generation = self.generation + 1
+
+    local ops_n = C.simdjson_ffi_parse_batch(state, batch_jsons, batch_lens, n, batch_ops, errmsg)
+    if ops_n == SIMDJSON_FFI_ERROR then
+        self.decoding = false
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    -- the batch holds whole documents, so the builders
+    -- never need to ask for more ops
+    local ops = batch_ops[0]
+    self.ops = ops
+    self.ops_index = 0
+    self.ops_size = ops_n
+
+    local res = table_new(n, 0)
+    local errs
+
+    for i = 1, n do
+        local ops_index = self.ops_index
+        local opcode = ops.opcodes[ops_index]
+        local payload = ops.payloads[ops_index]
+
+        self.ops_index = ops_index + 1
+
+        if opcode == SIMDJSON_FFI_OPCODE_ERROR then
+            if not errs then
+                errs = table_new(0, 4)
+            end
+
+            local str = payload.str
+            errs[i] = "simdjson: error: " .. ffi_string(ops.strings + str.offset, str.len)
+
+        else
+            self.keys_n = 0
+            res[i] = self:_build(opcode, payload)
+        end
+    end
+
+    assert(self.ops_index == ops_n)
+
+    self.decoding = false
+
+    return res, errs
+end
+
+
 return _M
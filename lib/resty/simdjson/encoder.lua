@@ -1,28 +1,188 @@
-local string_buffer = require("string.buffer")
-
-
 local _M = {}
 local _MT = { __index = _M, }
 
 
+local ffi = require("ffi")
+local C = require("resty.simdjson.cdefs")
+
+
 local type = type
 local assert = assert
+local error = error
 local setmetatable = setmetatable
+local ffi_new = ffi.new
+local ffi_gc = ffi.gc
+local ffi_string = ffi.string
+local ffi_istype = ffi.istype
 local ngx_null = ngx.null
 local ngx_sleep = ngx.sleep
 
 
-function _M.new(yieldable)
+local SIMDJSON_FFI_OPCODE_ARRAY = C.SIMDJSON_FFI_OPCODE_ARRAY
+local SIMDJSON_FFI_OPCODE_OBJECT = C.SIMDJSON_FFI_OPCODE_OBJECT
+local SIMDJSON_FFI_OPCODE_NUMBER = C.SIMDJSON_FFI_OPCODE_NUMBER
+local SIMDJSON_FFI_OPCODE_STRING = C.SIMDJSON_FFI_OPCODE_STRING
+local SIMDJSON_FFI_OPCODE_BOOLEAN = C.SIMDJSON_FFI_OPCODE_BOOLEAN
+local SIMDJSON_FFI_OPCODE_NULL = C.SIMDJSON_FFI_OPCODE_NULL
+local SIMDJSON_FFI_OPCODE_RETURN = C.SIMDJSON_FFI_OPCODE_RETURN
+local SIMDJSON_FFI_OPCODE_INT64 = C.SIMDJSON_FFI_OPCODE_INT64
+local SIMDJSON_FFI_OPCODE_UINT64 = C.SIMDJSON_FFI_OPCODE_UINT64
+local SIMDJSON_FFI_BATCH_SIZE = C.SIMDJSON_FFI_BATCH_SIZE
+local SIMDJSON_FFI_ERROR = -1
+
+
+local MAX_ITERATIONS = 2048
+-- one second, in microseconds
+local MAX_YIELD_BUDGET = 1000000
+local errmsg = require("resty.core.base").get_errmsg_ptr()
+local len_buf = ffi_new("size_t[1]")
+local number_buf = ffi_new("char[?]", C.SIMDJSON_FFI_NUMBER_BUF_SIZE)
+local int64_t = ffi.typeof("int64_t")
+local uint64_t = ffi.typeof("uint64_t")
+
+
+local function yielding()
+    ngx_sleep(0)
+end
+
+
+local function new_state(precision)
+    local state = C.simdjson_ffi_encoder_state_new()
+    if state == nil then
+        return nil
+    end
+
+    C.simdjson_ffi_encoder_state_set_precision(state, precision)
+
+    return ffi_gc(state, C.simdjson_ffi_encoder_state_free)
+end
+
+
+-- `opts` is the table passed to `simdjson.new()`, if any
+function _M.new(yieldable, opts)
+    local yield_budget = opts and opts.yield_budget
+
+    if yield_budget ~= nil then
+        assert(type(yield_budget) == "number" and yield_budget % 1 == 0 and
+               yield_budget >= 1 and yield_budget <= MAX_YIELD_BUDGET,
+               "yield_budget must be an integer between 1 and " .. MAX_YIELD_BUDGET)
+    end
+
+    local state = new_state(0)
+    if not state then
+        return nil, "no memory"
+    end
+
     local self = {
         yieldable = yieldable,
-        number_precision = "%.16g",  -- up to 16 decimals
+        yield_budget = yield_budget,  -- in microseconds, nil to yield every MAX_ITERATIONS
+        precision = 0,  -- shortest representation that round trips
+        state = state,
+        ops = nil,  -- reserved for encode
+        encoding = false,
+        yields = 0,  -- reported by `simdjson:stats()`
     }
 
     return setmetatable(self, _MT)
 end
 
 
+function _M:destroy()
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    if self.encoding then
+        error("encoding, can not be destroyed", 2)
+    end
+
+    C.simdjson_ffi_encoder_state_free(ffi_gc(state, nil))
+    self.state = nil
+    self.ops = nil
+end
+
+
+-- hands the ops collected so far to the C encoder
+local function encode_flush(ctx)
+    local n = ctx.ops_n
+    if n == 0 then
+        return true
+    end
+
+    if C.simdjson_ffi_encode(ctx.state, n, errmsg) == SIMDJSON_FFI_ERROR then
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    ctx.ops_n = 0
+    ctx.refs_n = 0
+
+    return true
+end
+
+
+-- returns the next free op, flushing the batch first if it is full
+local function encode_op(ctx)
+    local n = ctx.ops_n
+
+    if n == SIMDJSON_FFI_BATCH_SIZE then
+        local ok, err = encode_flush(ctx)
+        if not ok then
+            return nil, err
+        end
+
+        n = 0
+    end
+
+    ctx.ops_n = n + 1
+
+    return ctx.ops[n]
+end
+
+
+-- must be called only after the op returned by `encode_op()` is filled,
+-- `cost` roughly matches the number of tokens the Lua encoder used to emit
+local function encode_yield(ctx, cost)
+    if not ctx.yieldable then
+        return true
+    end
+
+    local iterations = ctx.iterations - cost
+
+    if iterations > 0 then
+        ctx.iterations = iterations
+        return true
+    end
+
+    -- iterations <= 0, should reset iterations then yield
+    ctx.iterations = MAX_ITERATIONS
+
+    local budget = ctx.yield_budget
+    if budget and C.simdjson_ffi_clock() - ctx.yielded_at < budget then
+        return true
+    end
+
+    local ok, err = encode_flush(ctx)
+    if not ok then
+        return nil, err
+    end
+
+    yielding()
+
+    local encoder = ctx.encoder
+    encoder.yields = encoder.yields + 1
+
+    if budget then
+        ctx.yielded_at = C.simdjson_ffi_clock()
+    end
+
+    return true
+end
+
+
 local encode_helper
+local encode_ops
 do
     local cjson = assert(require("cjson"))
     local cjson_empty_array = cjson.empty_array
@@ -31,57 +191,37 @@ do
     local pairs = pairs
     local tostring = tostring
     local getmetatable = getmetatable
-    local string_byte = string.byte
-    local string_char = string.char
     local tb_isempty = require("table.isempty")
     local tb_isarray = require("table.isarray")
     local tb_nkeys = require("table.nkeys")
 
-    local ESCAPE_TABLE = {
-        "\\u0001", "\\u0002", "\\u0003",
-        "\\u0004", "\\u0005", "\\u0006", "\\u0007",
-        "\\b", "\\t", "\\n", "\\u000b",
-        "\\f", "\\r", "\\u000e", "\\u000f",
-        "\\u0010", "\\u0011", "\\u0012", "\\u0013",
-        "\\u0014", "\\u0015", "\\u0016", "\\u0017",
-        "\\u0018", "\\u0019", "\\u001a", "\\u001b",
-        "\\u001c", "\\u001d", "\\u001e", "\\u001f",
-        nil, nil, "\\\"", nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, "\\/",
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, "\\\\", nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, "\\u007f",
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-        nil, nil, nil, nil, nil, nil, nil, nil,
-    }
+    -- strings up to 64 KB share one scratch buffer for escaping
+    local ESCAPE_BUF_MAX_SIZE = 64 * 1024 * 6
+
+    local escape_buf
+    local escape_buf_size = 0
+
+    local function escape_string(item)
+        local len = #item
+        local size = len * 6
+        local buf = escape_buf
 
-    ESCAPE_TABLE[0] = "\\u0000"
+        if size > escape_buf_size then
+            buf = ffi_new("char[?]", size)
+
+            if size <= ESCAPE_BUF_MAX_SIZE then
+                escape_buf = buf
+                escape_buf_size = size
+            end
+        end
 
-    for i = 0, 255 do
-        if not ESCAPE_TABLE[i] then
-            ESCAPE_TABLE[i] = string_char(i)
+        local n = C.simdjson_ffi_escape_string(item, len, buf)
+        if n == len then
+            -- nothing was escaped
+            return item
         end
+
+        return ffi_string(buf, n)
     end
 
     local function table_isarray(tbl)
@@ -179,17 +319,26 @@ do
 
         elseif typ == "string" then
             cb("\"", ctx)
-            for i = 1, #item do
-                cb(ESCAPE_TABLE[string_byte(item, i)], ctx)
+            if #item > 0 then
+                cb(escape_string(item), ctx)
             end
             cb("\"", ctx)
 
         elseif typ == "number" then
-            cb(self.number_precision:format(item), ctx)
+            local n = C.simdjson_ffi_format_number(item, self.precision, number_buf)
+            cb(ffi_string(number_buf, n), ctx)
 
         elseif typ == "boolean" then
             cb(tostring(item), ctx)
 
+        elseif typ == "cdata" and ffi_istype(int64_t, item) then
+            local n = C.simdjson_ffi_format_int64(item, number_buf)
+            cb(ffi_string(number_buf, n), ctx)
+
+        elseif typ == "cdata" and ffi_istype(uint64_t, item) then
+            local n = C.simdjson_ffi_format_uint64(item, number_buf)
+            cb(ffi_string(number_buf, n), ctx)
+
         elseif item == ngx_null then
             cb("null", ctx)
 
@@ -202,54 +351,192 @@ do
 
         return true
     end
-end
-_M.encode_helper = encode_helper
 
+    -- flattens `item` into the op stream consumed by `simdjson_ffi_encode()`
+    function encode_ops(ctx, item)
+        local typ = type(item)
+        local op, err = encode_op(ctx)
+        if not op then
+            return nil, err
+        end
 
-local MAX_ITERATIONS = 2048
+        local cost = 1
 
+        if typ == "table" then
+            local is_array, count = table_isarray(item)
 
-local function yielding()
-    ngx_sleep(0)
-end
+            if is_array then
+                op.opcode = SIMDJSON_FFI_OPCODE_ARRAY
 
+                local ok, err = encode_yield(ctx, 1)
+                if not ok then
+                    return nil, err
+                end
 
-local function encode_callback(s, ctx)
-    ctx.buf:put(s)
+                for i = 1, count do
+                    local v = item[i] or ngx_null
 
-    if not ctx.yieldable then
-        return
-    end
+                    local res, err = encode_ops(ctx, v)
+                    if not res then
+                        return nil, err
+                    end
+                end
 
-    local iterations = ctx.iterations
+            else
+                op.opcode = SIMDJSON_FFI_OPCODE_OBJECT
 
-    iterations = iterations - 1
+                local ok, err = encode_yield(ctx, 1)
+                if not ok then
+                    return nil, err
+                end
 
-    if iterations > 0 then
-        ctx.iterations = iterations
-        return
-    end
+                for k, v in pairs(item) do
+                    local kt = type(k)
+                    if kt ~= "string" and kt ~= "number" then
+                        return nil, "object key must be a number or string"
+                    end
 
-    -- iterations <= 0, should reset iterations then yield
-    ctx.iterations = MAX_ITERATIONS
+                    if kt == "number" then
+                        k = tostring(k)
+                    end
 
-    yielding()
+                    assert(encode_ops(ctx, k))
+
+                    if kt == "number" then
+                        -- keep the key string alive until its op is flushed
+                        local refs_n = ctx.refs_n + 1
+                        ctx.refs[refs_n] = k
+                        ctx.refs_n = refs_n
+                    end
+
+                    local res, err = encode_ops(ctx, v)
+                    if not res then
+                        return nil, err
+                    end
+                end
+            end
+
+            op, err = encode_op(ctx)
+            if not op then
+                return nil, err
+            end
+
+            op.opcode = SIMDJSON_FFI_OPCODE_RETURN
+
+        elseif typ == "string" then
+            op.opcode = SIMDJSON_FFI_OPCODE_STRING
+            op.size = #item
+            op.val.str = item
+
+            cost = cost + #item
+
+        elseif typ == "number" then
+            op.opcode = SIMDJSON_FFI_OPCODE_NUMBER
+            op.val.number = item
+
+        elseif typ == "boolean" then
+            op.opcode = SIMDJSON_FFI_OPCODE_BOOLEAN
+            op.val.boolean = item and 1 or 0
+
+        elseif typ == "cdata" and ffi_istype(int64_t, item) then
+            op.opcode = SIMDJSON_FFI_OPCODE_INT64
+            op.val.i64 = item
+
+        elseif typ == "cdata" and ffi_istype(uint64_t, item) then
+            op.opcode = SIMDJSON_FFI_OPCODE_UINT64
+            op.val.u64 = item
+
+        elseif item == ngx_null then
+            op.opcode = SIMDJSON_FFI_OPCODE_NULL
+
+        elseif item == cjson_empty_array then
+            op.opcode = SIMDJSON_FFI_OPCODE_ARRAY
+
+            op, err = encode_op(ctx)
+            if not op then
+                return nil, err
+            end
+
+            op.opcode = SIMDJSON_FFI_OPCODE_RETURN
+
+        else
+            return nil, "unsupported data type: " .. typ
+        end
+
+        return encode_yield(ctx, cost)
+    end
 end
+_M.encode_helper = encode_helper
 
 
 function _M:process(item)
+    local state = self.state
+
+    if not state then
+        error("already destroyed", 2)
+    end
+
+    local ops = self.ops
+    local owner = not self.encoding
+
+    if owner then
+        if not ops then
+            -- allocate array memory on-demond
+            ops = assert(C.simdjson_ffi_encoder_state_get_ops(state))
+            self.ops = ops
+        end
+
+        self.encoding = true
+
+    else
+        -- a yielded encode is still using this instance,
+        -- use a temporary state to keep :encode() reentrant
+        state = new_state(self.precision)
+        if not state then
+            return nil, "no memory"
+        end
+
+        ops = assert(C.simdjson_ffi_encoder_state_get_ops(state))
+    end
+
+    C.simdjson_ffi_encoder_state_reset(state)
+
     local ctx = {
-        buf = string_buffer.new(),
+        encoder = self,
+        state = state,
+        ops = ops,
+        ops_n = 0,
+        refs = {},
+        refs_n = 0,
         iterations = MAX_ITERATIONS,
         yieldable = self.yieldable,
+        yield_budget = self.yield_budget,
+        yielded_at = self.yield_budget and C.simdjson_ffi_clock(),
     }
 
-    local res, err = encode_helper(self, item, encode_callback, ctx)
-    if not res then
-        return nil, err
+    local res, err = encode_ops(ctx, item)
+    if res then
+        res, err = encode_flush(ctx)
+    end
+
+    if res then
+        local json = C.simdjson_ffi_encode_finish(state, len_buf, errmsg)
+        if json == nil then
+            res, err = nil, "simdjson: error: " .. ffi_string(errmsg[0])
+
+        else
+            res = ffi_string(json, len_buf[0])
+        end
     end
 
-    return ctx.buf:tostring()
+    -- the output was copied, release its buffer if it grew too large
+    C.simdjson_ffi_encoder_state_reset(state)
+
+    if owner then
+        self.encoding = false
+    end
+
+    return res, err
 end
 
 
@@ -258,7 +545,11 @@ function _M:encode_number_precision(precision)
     assert(math.floor(precision) == precision)
     assert(precision >= 1 and precision <= 16)
 
-    self.number_precision = "%." .. precision .. "g"
+    self.precision = precision
+
+    if self.state then
+        C.simdjson_ffi_encoder_state_set_precision(self.state, precision)
+    end
 end
 
 
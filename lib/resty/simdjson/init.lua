@@ -1,31 +1,105 @@
 local decoder = require("resty.simdjson.decoder")
 local encoder = require("resty.simdjson.encoder")
+local pool = require("resty.simdjson.pool")
+local util = require("resty.simdjson.util")
 
 
 local _M = {}
 local _MT = { __index = _M, }
 
 
+local type = type
 local setmetatable = setmetatable
 
 
-function _M.new(yieldable)
+function _M.new(opts)
+    local yieldable
+
+    if type(opts) == "table" then
+        yieldable = opts.yieldable
+
+    else
+        yieldable = opts
+        opts = nil
+    end
+
     local self = {
-      decoder = decoder.new(yieldable),
-      encoder = encoder.new(yieldable),
+      decoder = decoder.new(yieldable, opts),
+      encoder = encoder.new(yieldable, opts),
     }
 
     return setmetatable(self, _MT)
 end
 
 
+_M.minify = util.minify
+_M.validate_utf8 = util.validate_utf8
+_M.validate_utf8_ptr = util.validate_utf8_ptr
+
+
+function _M.new_pool(opts)
+    return pool.new(_M.new, opts)
+end
+
+
 function _M:destroy()
     self.decoder:destroy()
+    self.encoder:destroy()
+end
+
+
+function _M:decode(json, opts)
+    return self.decoder:process(json, opts and opts.projection)
+end
+
+
+function _M:decode_ptr(ptr, len, padded, opts)
+    return self.decoder:process_ptr(ptr, len, padded, opts and opts.projection)
+end
+
+
+function _M:decode_many(json, opts)
+    return self.decoder:process_many(json, opts and opts.projection)
+end
+
+
+function _M:decode_batch(jsons, opts)
+    return self.decoder:process_batch(jsons, opts and opts.projection)
+end
+
+
+function _M:append(chunk)
+    return self.decoder:append(chunk)
+end
+
+
+function _M:discard()
+    return self.decoder:discard()
+end
+
+
+function _M:finish(opts)
+    return self.decoder:process_body(opts and opts.projection)
+end
+
+
+function _M:validate(json)
+    return self.decoder:validate(json)
+end
+
+
+function _M:get(json, pointer)
+    return self.decoder:at_pointer(json, pointer)
+end
+
+
+function _M:memory()
+    return self.decoder:memory()
 end
 
 
-function _M:decode(json)
-    return self.decoder:process(json)
+function _M:stats()
+    return self.decoder:stats(self.encoder.yields)
 end
 
 
@@ -0,0 +1,123 @@
+local _M = {}
+local _MT = { __index = _M, }
+
+
+local type = type
+local assert = assert
+local error = error
+local setmetatable = setmetatable
+
+
+local DEFAULT_SIZE = 16
+
+
+-- `new_parser` is `simdjson.new()`, called with `opts` whenever the pool
+-- runs dry. `opts.size` is the number of idle parsers kept around.
+function _M.new(new_parser, opts)
+    local size = DEFAULT_SIZE
+
+    if opts ~= nil then
+        assert(type(opts) == "table", "opts must be a table")
+
+        if opts.size ~= nil then
+            size = opts.size
+            assert(type(size) == "number" and size % 1 == 0 and size >= 0,
+                   "size must be a non-negative integer")
+        end
+    end
+
+    local self = {
+        new_parser = new_parser,
+        opts = opts,
+        size = size,
+        parsers = {},  -- idle parsers, the most recently used last
+        n = 0,
+        idle = setmetatable({}, { __mode = "k" }),  -- set of the idle parsers
+    }
+
+    return setmetatable(self, _MT)
+end
+
+
+-- Returns an idle parser, or a new one if there is none. The parser is
+-- owned by the caller until handed back with `:checkin()`.
+function _M:checkout()
+    local n = self.n
+
+    if n == 0 then
+        return self.new_parser(self.opts)
+    end
+
+    -- LIFO, the warmest buffers are reused first
+    local parser = self.parsers[n]
+
+    self.parsers[n] = nil
+    self.n = n - 1
+    self.idle[parser] = nil
+
+    return parser
+end
+
+
+-- Hands `parser` back to the pool, it must not be used by the caller
+-- anymore. Parsers beyond the size of the pool are destroyed.
+function _M:checkin(parser)
+    if self.idle[parser] then
+        error("parser already checked in", 2)
+    end
+
+    local decoder = parser.decoder
+    local encoder = parser.encoder
+
+    if not decoder.state or not encoder.state then
+        -- destroyed by the caller
+        return
+    end
+
+    if decoder.decoding or encoder.encoding then
+        -- an error was thrown half way, leave it to the GC
+        return
+    end
+
+    local n = self.n
+
+    if n >= self.size then
+        parser:destroy()
+        return
+    end
+
+    -- a body left unfinished must not leak into the next checkout
+    parser:discard()
+
+    n = n + 1
+
+    self.parsers[n] = parser
+    self.n = n
+    self.idle[parser] = true
+end
+
+
+-- Destroys the idle parsers, the pool can still be used afterwards.
+function _M:flush()
+    local parsers = self.parsers
+
+    for i = self.n, 1, -1 do
+        local parser = parsers[i]
+
+        parsers[i] = nil
+        self.idle[parser] = nil
+
+        parser:destroy()
+    end
+
+    self.n = 0
+end
+
+
+-- Number of idle parsers.
+function _M:count()
+    return self.n
+end
+
+
+return _M
@@ -0,0 +1,90 @@
+local _M = {}
+
+
+local ffi = require("ffi")
+local C = require("resty.simdjson.cdefs")
+
+
+local type = type
+local assert = assert
+local ffi_new = ffi.new
+local ffi_cast = ffi.cast
+local ffi_string = ffi.string
+local math_max = math.max
+local math_min = math.min
+
+
+local SIMDJSON_FFI_ERROR = -1
+
+
+local errmsg = require("resty.core.base").get_errmsg_ptr()
+local len_buf = ffi_new("size_t[1]")
+local char_ptr_t = ffi.typeof("char *")
+-- grown on demand, shared by all the callers, larger outputs get a
+-- buffer of their own, which is garbage collected like the string
+local OUT_BUF_MAX_SIZE = 1024 * 1024
+local out_buf
+local out_size = 0
+
+
+local function get_out_buf(size)
+    if size <= out_size then
+        return out_buf
+    end
+
+    if size > OUT_BUF_MAX_SIZE then
+        return ffi_new("char[?]", size)
+    end
+
+    out_size = math_min(math_max(size, out_size * 2, 4096), OUT_BUF_MAX_SIZE)
+    out_buf = ffi_new("char[?]", out_size)
+
+    return out_buf
+end
+
+
+-- Returns `json` without the whitespace between its tokens. If the
+-- string.buffer `buf` is given, the result is appended to it instead.
+function _M.minify(json, buf)
+    assert(type(json) == "string")
+
+    local len = #json
+    local out
+
+    if buf then
+        -- the output is never longer than the input
+        out = ffi_cast(char_ptr_t, (buf:reserve(len)))
+
+    else
+        out = get_out_buf(len)
+    end
+
+    if C.simdjson_ffi_minify(json, len, out, len_buf, errmsg) == SIMDJSON_FFI_ERROR then
+        return nil, "simdjson: error: " .. ffi_string(errmsg[0])
+    end
+
+    if buf then
+        return buf:commit(len_buf[0])
+    end
+
+    return ffi_string(out, len_buf[0])
+end
+
+
+function _M.validate_utf8(str)
+    assert(type(str) == "string")
+
+    return C.simdjson_ffi_validate_utf8(str, #str) == 1
+end
+
+
+-- Same as `validate_utf8()`, for `len` bytes of C memory at `ptr`.
+function _M.validate_utf8_ptr(ptr, len)
+    assert(type(ptr) == "cdata")
+    assert(type(len) == "number" and len % 1 == 0 and len >= 0)
+
+    return C.simdjson_ffi_validate_utf8(ffi_cast(char_ptr_t, ptr), len) == 1
+end
+
+
+return _M
@@ -1,6 +1,19 @@
 #include "simdjson.h"
 #include "simdjson_ffi.h"
 
+#if SIMDJSON_IS_X86_64
+#include <immintrin.h>
+#elif SIMDJSON_IS_ARM64
+#include <arm_neon.h>
+#endif
+
+// the Lua C API table builder is only compiled in when the Lua headers
+// are found, see `LUA_INCLUDE_DIR` in the Makefile
+#if __has_include(<lua.hpp>)
+#include <lua.hpp>
+#define SIMDJSON_FFI_LUA_API 1
+#endif
+
 
 using namespace simdjson;
 
@@ -27,13 +40,30 @@ static bool need_allocation(const char *buf, size_t len) {
 }
 
 
+// Like below, the copy of `buf`, if one is needed, goes to `copy`.
+static padded_string_view get_padded_string_view(
+    simdjson_ffi_state &state, const char *buf, size_t len, padded_string &copy) {
+
+    // unlikely case
+    if (simdjson_unlikely(need_allocation(buf, len))) {
+      copy = padded_string(buf, len);
+      state.stats.copied += len;
+      return copy;
+    }
+
+    // no reallcation needed (very likely)
+    return padded_string_view(buf, len, len + SIMDJSON_PADDING);
+}
+
+
 static padded_string_view get_padded_string_view(
-    const char *buf, size_t len, padded_string &jsonbuffer) {
+    simdjson_ffi_state &state, const char *buf, size_t len) {
 
     // unlikely case
     if (simdjson_unlikely(need_allocation(buf, len))) {
-      jsonbuffer = padded_string(buf, len);
-      return jsonbuffer;
+      state.json = padded_string(buf, len);
+      state.stats.copied += len;
+      return state.json;
     }
 
     // no reallcation needed (very likely)
@@ -41,17 +71,99 @@ static padded_string_view get_padded_string_view(
 }
 
 
-// T may be ondemand::value or state->document
+// Copies `str` into the string arena of the batch, and points
+// the payload of the op being emitted at it.
+static void simdjson_set_string(simdjson_ffi_state &state, std::string_view str) {
+    auto &strings = state.strings;
+    auto &payload = state.payloads[state.ops_n];
+
+    std::memcpy(strings.reserve(str.size()), str.data(), str.size());
+
+    payload.str.offset = strings.size;
+    payload.str.len = str.size();
+
+    strings.size += str.size();
+}
+
+
+static void simdjson_check_string(simdjson_ffi_state &state, std::string_view str) {
+    if (simdjson_unlikely(str.size() > state.limits.max_string_length)) {
+        throw simdjson_ffi_limit_error(
+            "LIMIT_EXCEEDED: A string is longer than max_string_length.");
+    }
+}
+
+
+static void simdjson_check_elements(simdjson_ffi_state &state, size_t n) {
+    if (simdjson_unlikely(n > state.limits.max_elements)) {
+        throw simdjson_ffi_limit_error(
+            "LIMIT_EXCEEDED: A container has more elements than max_elements.");
+    }
+}
+
+
+static void simdjson_check_document_size(simdjson_ffi_state &state, size_t len) {
+    if (simdjson_unlikely(len > state.limits.max_document_size)) {
+        throw simdjson_ffi_limit_error(
+            "LIMIT_EXCEEDED: The document is larger than max_document_size.");
+    }
+}
+
+
+// Counts an error of `code` in the stats of `state`.
+static void simdjson_count_error(simdjson_ffi_state &state, error_code code) {
+    state.stats.errors[code]++;
+}
+
+
+// Counts `e` in the stats of `state`, returns its message.
+static const char *simdjson_count_error(simdjson_ffi_state &state, const simdjson_error &e) {
+    if (dynamic_cast<const simdjson_ffi_limit_error *>(&e)) {
+        state.stats.limits++;
+
+    } else {
+        simdjson_count_error(state, e.error());
+    }
+
+    return e.what();
+}
+
+
+static uint32_t simdjson_size_hint(size_t n) {
+    return static_cast<uint32_t>(std::min<size_t>(n, std::numeric_limits<uint32_t>::max()));
+}
+
+
+// T may be ondemand::value, state->document or a document_reference,
+// `projection` is only relevant if value is an array or object
 template<typename T>
-static bool simdjson_process_value(simdjson_ffi_state &state, T&& value) {
+static bool simdjson_process_value(simdjson_ffi_state &state, T&& value,
+    const simdjson_ffi_projection *projection = nullptr) {
     bool go_deeper = false;
 
+    if (simdjson_unlikely(++state.values > state.limits.max_values)) {
+        throw simdjson_ffi_limit_error(
+            "LIMIT_EXCEEDED: The document has more values than max_values.");
+    }
+
     switch (value.type()) {
     case ondemand::json_type::array: {
-        state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_ARRAY;
+        state.opcodes[state.ops_n] = SIMDJSON_FFI_OPCODE_ARRAY;
 
         ondemand::array a = value;
-        state.frames.emplace(a);
+        size_t elements = 0;
+
+        // a size hint so that Lua can preallocate the table, counting walks
+        // the whole container, so doing it at every level of a deep document
+        // would walk the same bytes once per level
+        if (state.frames.n < SIMDJSON_FFI_COUNT_DEPTH) {
+            elements = a.count_elements();
+
+            simdjson_check_elements(state, elements);
+        }
+
+        state.payloads[state.ops_n].size = simdjson_size_hint(elements);
+        state.frames.push(a, projection);
 
         go_deeper = true;
 
@@ -59,10 +171,23 @@ static bool simdjson_process_value(simdjson_ffi_state &state, T&& value) {
     }
 
     case ondemand::json_type::object: {
-        state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_OBJECT;
+        state.opcodes[state.ops_n] = SIMDJSON_FFI_OPCODE_OBJECT;
 
         ondemand::object o = value;
-        state.frames.emplace(o);
+        size_t fields = 0;
+
+        // same as arrays above, projected objects keep no more than the
+        // projected fields and need no counting
+        if (!projection && state.frames.n < SIMDJSON_FFI_COUNT_DEPTH) {
+            fields = o.count_fields();
+
+            simdjson_check_elements(state, fields);
+        }
+
+        state.payloads[state.ops_n].size = projection
+                                           ? simdjson_size_hint(projection->fields.size())
+                                           : simdjson_size_hint(fields);
+        state.frames.push(o, projection);
 
         go_deeper = true;
 
@@ -70,25 +195,68 @@ static bool simdjson_process_value(simdjson_ffi_state &state, T&& value) {
     }
 
     case ondemand::json_type::number: {
-        state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_NUMBER;
-        state.ops[state.ops_n].val.number = double(value);
+        auto &opcode = state.opcodes[state.ops_n];
+        auto &payload = state.payloads[state.ops_n];
+
+        // integers do not need to go through the float parser
+        switch (value.get_number_type()) {
+        case ondemand::number_type::signed_integer: {
+            int64_t i = value.get_int64();
+
+            if (state.int64 && (i > SIMDJSON_FFI_MAX_SAFE_INTEGER ||
+                                i < -SIMDJSON_FFI_MAX_SAFE_INTEGER)) {
+                opcode = SIMDJSON_FFI_OPCODE_INT64;
+                payload.i64 = i;
+
+            } else {
+                opcode = SIMDJSON_FFI_OPCODE_NUMBER;
+                // "-0" is an integer too, but only the float parser keeps its sign
+                payload.number = i != 0 ? static_cast<double>(i) : double(value);
+            }
+
+            break;
+        }
+
+        case ondemand::number_type::unsigned_integer: {
+            // always beyond INT64_MAX
+            uint64_t u = value.get_uint64();
+
+            if (state.int64) {
+                opcode = SIMDJSON_FFI_OPCODE_UINT64;
+                payload.u64 = u;
+
+            } else {
+                opcode = SIMDJSON_FFI_OPCODE_NUMBER;
+                payload.number = static_cast<double>(u);
+            }
+
+            break;
+        }
+
+        default:
+            // floats and integers beyond 64 bits
+            opcode = SIMDJSON_FFI_OPCODE_NUMBER;
+            payload.number = double(value);
+        }
 
         break;
     }
 
     case ondemand::json_type::string: {
-        state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_STRING;
-        std::string_view str = value;
+        state.opcodes[state.ops_n] = SIMDJSON_FFI_OPCODE_STRING;
+        // not a conversion, which would reject a root string followed by
+        // the next document for document_reference
+        std::string_view str = value.get_string();
 
-        state.ops[state.ops_n].size = str.size();
-        state.ops[state.ops_n].val.str = str.data();
+        simdjson_check_string(state, str);
+        simdjson_set_string(state, str);
 
         break;
     }
 
     case ondemand::json_type::boolean: {
-        state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_BOOLEAN;
-        state.ops[state.ops_n].val.boolean = bool(value);
+        state.opcodes[state.ops_n] = SIMDJSON_FFI_OPCODE_BOOLEAN;
+        state.payloads[state.ops_n].boolean = bool(value);
 
         break;
     }
@@ -96,7 +264,7 @@ static bool simdjson_process_value(simdjson_ffi_state &state, T&& value) {
     case ondemand::json_type::null: {
         SIMDJSON_DEVELOPMENT_ASSERT(value.is_null());
 
-        state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_NULL;
+        state.opcodes[state.ops_n] = SIMDJSON_FFI_OPCODE_NULL;
 
         break;
     }
@@ -111,201 +279,2397 @@ static bool simdjson_process_value(simdjson_ffi_state &state, T&& value) {
 }
 
 
-template<>
-bool simdjson_process_value(simdjson_ffi_state &state, simdjson_result<std::string_view>&& key) {
-    state.ops[state.ops_n].opcode = SIMDJSON_FFI_OPCODE_STRING;
-    std::string_view str = key.value();
+// Emits KEY for the first occurrence of a key in the document, Lua then
+// remembers it under the next id. Repeats are emitted as KEY_ID with the
+// id as payload. Keys which did not fit in the table are plain STRINGs.
+static void simdjson_process_key(simdjson_ffi_state &state, std::string_view key) {
+    bool inserted;
+
+    simdjson_check_string(state, key);
+
+    uint32_t id = state.keys.intern(key, inserted);
 
-    state.ops[state.ops_n].size = str.size();
-    state.ops[state.ops_n].val.str = str.data();
+    if (id > 0) {
+        state.opcodes[state.ops_n] = SIMDJSON_FFI_OPCODE_KEY_ID;
+        state.payloads[state.ops_n].size = id;
+
+    } else {
+        state.opcodes[state.ops_n] = inserted ? SIMDJSON_FFI_OPCODE_KEY
+                                              : SIMDJSON_FFI_OPCODE_STRING;
+        simdjson_set_string(state, key);
+    }
 
     state.ops_n++;
+}
 
-    return false;
+
+// Returns the projection to apply to the value of `key`, or nullptr if
+// the whole value should be kept. `skip` is set if the field should not
+// be streamed at all.
+template<typename T>
+static const simdjson_ffi_projection *simdjson_project_field(
+    const simdjson_ffi_projection &projection, std::string_view key, T&& value,
+    bool &skip) {
+
+    auto found = projection.fields.find(key);
+    if (found == projection.fields.end()) {
+        skip = true;
+        return nullptr;
+    }
+
+    const simdjson_ffi_projection *child = found->second.get();
+    if (child->all) {
+        skip = false;
+        return nullptr;
+    }
+
+    // the projected paths go deeper, which is impossible for a scalar
+    ondemand::json_type type = value.type();
+    skip = type != ondemand::json_type::array && type != ondemand::json_type::object;
+
+    return child;
 }
 
 
+// `batch_size` is the number of ops handed to Lua at once, 0 means
+// `SIMDJSON_FFI_BATCH_SIZE`. Smaller batches take less memory and let
+// yieldable decodes yield more often, larger ones cross the FFI less.
+// `max_depth` is the deepest nesting decoded, 0 means `SIMDJSON_FFI_MAX_DEPTH`.
 extern "C"
-simdjson_ffi_state *simdjson_ffi_state_new() {
+simdjson_ffi_state *simdjson_ffi_state_new(size_t batch_size, size_t max_depth) {
+    SIMDJSON_DEVELOPMENT_ASSERT(batch_size == 0 ||
+        (batch_size >= SIMDJSON_FFI_MIN_BATCH_SIZE && batch_size <= SIMDJSON_FFI_MAX_BATCH_SIZE));
+    SIMDJSON_DEVELOPMENT_ASSERT(max_depth <= SIMDJSON_FFI_MAX_DEPTH_LIMIT);
+
     auto state = new(std::nothrow) simdjson_ffi_state();
 
     SIMDJSON_DEVELOPMENT_ASSERT(state);
 
+    if (state && batch_size != 0) {
+        state->batch_size = batch_size;
+    }
+
+    if (state && max_depth != 0) {
+        state->frames.max_depth = max_depth;
+    }
+
     return state;
 }
 
 
+static void simdjson_reserve_ops(simdjson_ffi_state &state) {
+    state.opcodes.resize(state.batch_size);
+    state.payloads.resize(state.batch_size);
+    state.frames.reserve();
+
+    state.ops.opcodes = state.opcodes.data();
+    state.ops.payloads = state.payloads.data();
+}
+
+
+// Returns the batch the functions below stream the ops into, its
+// `strings` arena is updated by every call returning a batch.
 extern "C"
-simdjson_ffi_op_t *simdjson_ffi_state_get_ops(simdjson_ffi_state *state) {
+const simdjson_ffi_ops_t *simdjson_ffi_state_get_ops(simdjson_ffi_state *state) {
     SIMDJSON_DEVELOPMENT_ASSERT(state);
 
-    state->ops.resize(SIMDJSON_FFI_BATCH_SIZE);
+    simdjson_reserve_ops(*state);
 
-    SIMDJSON_DEVELOPMENT_ASSERT(state->ops.size() == SIMDJSON_FFI_BATCH_SIZE);
+    SIMDJSON_DEVELOPMENT_ASSERT(state->opcodes.size() == state->batch_size);
 
-    return state->ops.data();
+    return &state->ops;
 }
 
 
+// Batches are handed over to Lua once their strings take `bytes` bytes,
+// even if they hold less than `batch_size` ops.
 extern "C"
-void simdjson_ffi_state_free(simdjson_ffi_state *state) {
+void simdjson_ffi_state_set_batch_bytes(simdjson_ffi_state *state, size_t bytes) {
     SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(bytes > 0);
 
-    delete state;
+    state->batch_bytes = bytes;
 }
 
 
+// Integers beyond 2^53 are decoded as INT64/UINT64 ops instead of
+// being rounded to the nearest double, if `enable` is non-zero.
 extern "C"
-int simdjson_ffi_parse(simdjson_ffi_state *state,
-    const char *json, size_t len, const char **errmsg) try {
+void simdjson_ffi_state_set_int64(simdjson_ffi_state *state, int enable) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
 
+    state->int64 = enable != 0;
+}
+
+
+// Once the parser's capacity grows beyond `factor` times the median size
+// of the last `SIMDJSON_FFI_SHRINK_WINDOW` documents, its buffers are
+// shrunk back to the larger of that median and `baseline`. `factor` 0
+// disables shrinking, which is the default.
+extern "C"
+void simdjson_ffi_state_set_shrink(simdjson_ffi_state *state, size_t factor, size_t baseline) {
     SIMDJSON_DEVELOPMENT_ASSERT(state);
-    SIMDJSON_DEVELOPMENT_ASSERT(json);
-    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
 
-    state->document = state->parser.iterate(
-                          get_padded_string_view(json, len, state->json));
-    state->ops_n = 0;
+    state->shrink_factor = factor;
+    state->shrink_baseline = baseline;
+    state->sizes_n = 0;
+}
 
-    // the return value is intentionally ignored
-    // because JSON could be either a bare scalar or
-    // array/object at top level
-    simdjson_process_value(*state, state->document);
 
-    SIMDJSON_DEVELOPMENT_ASSERT(state->ops_n == 1);
+// Documents exceeding any of `limits` fail to decode with a LIMIT_EXCEEDED
+// error, as soon as it is found. The maximum depth is set by
+// `simdjson_ffi_state_new()` instead.
+extern "C"
+void simdjson_ffi_state_set_limits(simdjson_ffi_state *state, const simdjson_ffi_limits_t *limits) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(limits);
 
-    return state->ops_n;
+    auto limit = [](size_t n) { return n == 0 ? SIZE_MAX : n; };
 
-} catch (simdjson_error &e) {
-    *errmsg = e.what();
+    state->limits.max_document_size = limit(limits->max_document_size);
+    state->limits.max_elements = limit(limits->max_elements);
+    state->limits.max_values = limit(limits->max_values);
+    state->limits.max_string_length = limit(limits->max_string_length);
+}
 
-    // clean up tmp string on error to save memory
-    state->json = padded_string();
 
-    return SIMDJSON_FFI_ERROR;
+extern "C"
+void simdjson_ffi_state_memory(simdjson_ffi_state *state, simdjson_ffi_memory_t *memory) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(memory);
+
+    size_t capacity = state->parser.capacity();
+
+    memory->capacity = capacity;
+    // same as `ondemand::parser::allocate()`
+    memory->string_buf = capacity > 0
+                         ? SIMDJSON_ROUNDUP_N(5 * capacity / 3 + SIMDJSON_PADDING, 64)
+                         : 0;
+
+    memory->ops = state->opcodes.capacity() * sizeof(uint8_t) +
+                  state->payloads.capacity() * sizeof(simdjson_ffi_payload_t) +
+                  state->strings.capacity +
+                  state->batch_opcodes.capacity() * sizeof(uint8_t) +
+                  state->batch_payloads.capacity() * sizeof(simdjson_ffi_payload_t) +
+                  state->batch_strings.capacity;
+
+    if (state->frames.data) {
+        memory->ops += state->frames.max_depth * sizeof(simdjson_ffi_stack_frame);
+    }
+
+    if (state->keys.slots) {
+        memory->ops += simdjson_ffi_keys::SLOTS * sizeof(simdjson_ffi_keys::slot);
+    }
+
+    memory->copy = state->json.size() > 0 ? state->json.size() + SIMDJSON_PADDING : 0;
+    memory->dom_capacity = state->dom.capacity();
+    memory->body = state->body.capacity;
 }
 
 
 extern "C"
-int simdjson_ffi_is_eof(simdjson_ffi_state *state) {
+void simdjson_ffi_state_stats(simdjson_ffi_state *state, simdjson_ffi_stats_t *stats) {
     SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(stats);
 
-    return state->document.at_end();
+    *stats = state->stats;
+    stats->max_depth = state->frames.peak;
 }
 
 
+// Message of the `simdjson::error_code` `code`, starting with its name.
 extern "C"
-int simdjson_ffi_next(simdjson_ffi_state *state, const char **errmsg) try {
+const char *simdjson_ffi_error_message(int code) {
+    return error_message(static_cast<error_code>(code));
+}
+
+
+// Restricts documents decoded by `simdjson_ffi_parse()` to the given
+// paths, each of them is either a JSON Pointer or, if it does not start
+// with '/', a single top level key. Passing `n` = 0 removes the projection.
+extern "C"
+int simdjson_ffi_state_set_projection(simdjson_ffi_state *state,
+    const char **paths, const size_t *lens, size_t n, const char **errmsg) try {
+
     SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(paths || n == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(lens || n == 0);
     SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
-    SIMDJSON_DEVELOPMENT_ASSERT(state->ops.size() == SIMDJSON_FFI_BATCH_SIZE);
 
-    state->ops_n = 0;
+    state->projection.reset();
 
-    while (!state->frames.empty()) {
+    if (n == 0) {
+        return 0;
+    }
 
-        if (state->ops_n >= state->ops.size() - 1) {
-            // -1 for key value pair which requires 2 ops
-            return state->ops_n;
+    auto root = std::make_unique<simdjson_ffi_projection>();
+
+    auto child = [](simdjson_ffi_projection *node, std::string &&key) {
+        auto &child = node->fields[std::move(key)];
+        if (!child) {
+            child = std::make_unique<simdjson_ffi_projection>();
         }
 
-        auto &frame = state->frames.top();
+        return child.get();
+    };
 
-        switch (frame.state) {
-            case simdjson_ffi_resume_state::array: {
-                auto &it = frame.it.array.current;
+    for (size_t i = 0; i < n; i++) {
+        std::string_view path(paths[i], lens[i]);
+        simdjson_ffi_projection *node = root.get();
 
-                if (frame.processing) {
-                    ++it;
-                    frame.processing = false;
-                }
+        if (path.empty()) {
+            // the whole document, nothing to project
+            return 0;
+        }
 
-                // resume array iteration
-                for (; it != frame.it.array.end; ++it) {
-                    auto value = *it;
+        if (path[0] != '/') {
+            // a plain top level key
+            node = child(node, std::string(path));
 
-                    if (simdjson_process_value(*state, value)) {
-                        // save state, go deeper
-                        frame.processing = true;
+        } else {
+            while (!path.empty() && !node->all) {
+                path.remove_prefix(1);
 
-                        break;
-                    }
+                size_t end = path.find('/');
+                std::string_view token = path.substr(0, end);
+                std::string key;
 
-                    if (state->ops_n >= state->ops.size()) {
-                        // array can use the last of the slots, no need to
-                        // reserve two slots like object below
-                        frame.processing = true;
+                // unescape "~1" and "~0" as per RFC 6901
+                for (size_t j = 0; j < token.size(); j++) {
+                    if (token[j] != '~') {
+                        key += token[j];
+                        continue;
+                    }
 
-                        return state->ops_n;
+                    if (j + 1 < token.size() && (token[j + 1] == '0' || token[j + 1] == '1')) {
+                        key += token[++j] == '0' ? '~' : '/';
+                        continue;
                     }
+
+                    *errmsg = "invalid projection path";
+                    return SIMDJSON_FFI_ERROR;
                 }
 
-                break;
+                // arrays are transparent, an array index would silently
+                // match nothing
+                if (!key.empty() && key.find_first_not_of("0123456789") == std::string::npos) {
+                    *errmsg = "array indices are not supported in projection paths";
+                    return SIMDJSON_FFI_ERROR;
+                }
+
+                node = child(node, std::move(key));
+                path = end == std::string_view::npos ? std::string_view() : path.substr(end);
             }
+        }
 
-            case simdjson_ffi_resume_state::object: {
-                auto &it = frame.it.object.current;
+        // everything below the last token is kept
+        node->all = true;
+        node->fields.clear();
+    }
 
-                if (frame.processing) {
-                    ++it;
-                    frame.processing = false;
-                }
+    state->projection = std::move(root);
 
-                // resume object iteration
-                for (; it != frame.it.object.end; ++it) {
-                    auto field = *it;
+    return 0;
 
-#if SIMDJSON_DEVELOPMENT_CHECKS
-                    SIMDJSON_DEVELOPMENT_ASSERT(!simdjson_process_value(*state, field.unescaped_key()));
-#else
-                    // the return value is intentionally ignored
-                    // because the key must be a string
-                    simdjson_process_value(*state, field.unescaped_key());
-#endif
+} catch (std::bad_alloc &e) {
+    *errmsg = "no memory";
 
-                    // this can not overflow, because we checked to make sure
-                    // ops has at least 2 empty slots above
+    return SIMDJSON_FFI_ERROR;
+}
 
-                    if (simdjson_process_value(*state, field.value())) {
-                        // save state, go deeper
-                        frame.processing = true;
 
-                        break;
-                    }
+extern "C"
+void simdjson_ffi_state_free(simdjson_ffi_state *state) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
 
-                    if (state->ops_n >= state->ops.size() - 1) {
-                        frame.processing = true;
+    delete state;
+}
 
-                        return state->ops_n;
-                    }
-                }
 
-                break;
-            }
+// Counts the batch about to be handed over in the stats.
+static void simdjson_count_ops(simdjson_ffi_state &state) {
+    auto &stats = state.stats;
 
-            default:
-                SIMDJSON_UNREACHABLE();
-        }
+    stats.batches++;
 
-        if (!frame.processing) {
-            state->frames.pop();
+    for (size_t i = 0; i < state.ops_n; i++) {
+        stats.ops[state.opcodes[i]]++;
+    }
+}
+
+
+// Hands the batch over to Lua, returns the number of ops in it.
+static int simdjson_flush(simdjson_ffi_state &state) {
+    simdjson_count_ops(state);
+
+    // the arena might have been reallocated
+    state.ops.strings = state.strings.data.get();
+
+    return state.ops_n;
+}
+
+
+// Applies the shrink policy before decoding `len` bytes of input. The
+// median of a full window is required, so a single small document never
+// shrinks the parser, and the window starts over after every shrink.
+// Only called when nothing points into the buffers being released, which
+// for `dom_only` are those of the DOM parser alone.
+static void simdjson_shrink(simdjson_ffi_state &state, size_t len, bool dom_only = false) {
+    if (state.shrink_factor == 0) {
+        return;
+    }
 
-            state->ops[state->ops_n++].opcode = SIMDJSON_FFI_OPCODE_RETURN;
+    state.sizes[state.sizes_n++ % SIMDJSON_FFI_SHRINK_WINDOW] = len;
+
+    if (state.sizes_n < SIMDJSON_FFI_SHRINK_WINDOW) {
+        return;
+    }
+
+    size_t sizes[SIMDJSON_FFI_SHRINK_WINDOW];
+    std::copy(state.sizes, state.sizes + SIMDJSON_FFI_SHRINK_WINDOW, sizes);
+    std::nth_element(sizes, sizes + SIMDJSON_FFI_SHRINK_WINDOW / 2,
+                     sizes + SIMDJSON_FFI_SHRINK_WINDOW);
+
+    size_t median = sizes[SIMDJSON_FFI_SHRINK_WINDOW / 2];
+    size_t limit = std::max(median, state.shrink_baseline);
+    size_t threshold = median * state.shrink_factor;
+
+    bool shrunk = false;
+
+    if (state.dom.capacity() > limit && state.dom.capacity() > threshold) {
+        auto err = state.dom.allocate(std::max(limit, len), state.dom.max_depth());
+        (void) err;
+
+        shrunk = true;
+    }
+
+    if (dom_only) {
+        if (shrunk) {
+            state.sizes_n = 0;
         }
+
+        return;
     }
 
-    SIMDJSON_DEVELOPMENT_ASSERT(state->frames.empty());
+    if (state.parser.capacity() > limit && state.parser.capacity() > threshold) {
+        // the parser grows back on demand should this fail,
+        // there is no need to allocate more than `len` now
+        auto err = state.parser.allocate(std::max(limit, len));
+        (void) err;
+
+        shrunk = true;
+    }
+
+    // strings of a batch take at most the size of the document
+    if (state.strings.capacity > limit && state.strings.capacity > threshold) {
+        state.strings = simdjson_ffi_buffer();
+        shrunk = true;
+    }
+
+    if (state.batch_strings.capacity > limit && state.batch_strings.capacity > threshold) {
+        state.batch_strings = simdjson_ffi_buffer();
+        shrunk = true;
+    }
+
+    // unless a body is being appended or decoded
+    if (state.body.size == 0 && state.body.capacity > limit && state.body.capacity > threshold) {
+        state.body = simdjson_ffi_buffer();
+        shrunk = true;
+    }
+
+    if (shrunk) {
+        state.sizes_n = 0;
+    }
+}
+
+
+// Starts iterating a new document, dropping whatever was left
+// from the previous one in case it was not fully consumed.
+static void simdjson_iterate(simdjson_ffi_state &state, padded_string_view json) {
+    state.frames.clear();
+    state.ops_n = 0;
+    state.values = 0;
+    state.strings.size = 0;
+    state.streaming = false;
+    state.keys.clear();
+
+    state.stats.documents++;
+    state.stats.bytes += json.length();
+
+    state.document = state.parser.iterate(json);
+}
+
+
+static void simdjson_iterate(simdjson_ffi_state &state, const char *json, size_t len) {
+    // before `json` might be copied
+    simdjson_check_document_size(state, len);
+
+    simdjson_iterate(state, get_padded_string_view(state, json, len));
+}
 
-    // we are done! clean up the tmp string to save memory
-    state->json = padded_string();
 
-    return state->ops_n;
+extern "C"
+int simdjson_ffi_parse(simdjson_ffi_state *state,
+    const char *json, size_t len, const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(json);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    simdjson_shrink(*state, len);
+    simdjson_iterate(*state, json, len);
+
+    // the return value is intentionally ignored
+    // because JSON could be either a bare scalar or
+    // array/object at top level
+    simdjson_process_value(*state, state->document, state->projection.get());
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->ops_n == 1);
+
+    return simdjson_flush(*state);
 
 } catch (simdjson_error &e) {
-    *errmsg = e.what();
+    *errmsg = simdjson_count_error(*state, e);
 
     // clean up tmp string on error to save memory
     state->json = padded_string();
 
     return SIMDJSON_FFI_ERROR;
 }
+
+
+// Like `simdjson_ffi_parse()`, for callers guaranteeing that `SIMDJSON_PADDING`
+// bytes past the end of `json` are readable, so it is never copied.
+extern "C"
+int simdjson_ffi_parse_padded(simdjson_ffi_state *state,
+    const char *json, size_t len, const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(json);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    simdjson_check_document_size(*state, len);
+    simdjson_shrink(*state, len);
+    simdjson_iterate(*state, padded_string_view(json, len, len + SIMDJSON_PADDING));
+
+    simdjson_process_value(*state, state->document, state->projection.get());
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->ops_n == 1);
+
+    return simdjson_flush(*state);
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Appends `len` bytes of `chunk` to the body decoded by the next call to
+// `simdjson_ffi_parse_body()`, copying them once. The body is dropped on
+// errors, the next append starts a new one.
+extern "C"
+int simdjson_ffi_append(simdjson_ffi_state *state,
+    const char *chunk, size_t len, const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(chunk || len == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    auto &body = state->body;
+
+    simdjson_check_document_size(*state, body.size + len);
+
+    // room for the padding too, which is never written
+    std::memcpy(body.reserve(len + SIMDJSON_PADDING), chunk, len);
+
+    body.size += len;
+
+    return 0;
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    state->body.size = 0;
+
+    return SIMDJSON_FFI_ERROR;
+
+} catch (std::bad_alloc &) {
+    simdjson_count_error(*state, MEMALLOC);
+    *errmsg = "no memory";
+
+    state->body.size = 0;
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Drops the body appended so far, keeping its buffer.
+extern "C"
+void simdjson_ffi_discard_body(simdjson_ffi_state *state) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    state->body.size = 0;
+}
+
+
+// Like `simdjson_ffi_parse()`, but decodes the body appended by
+// `simdjson_ffi_append()` in place. The body is emptied, yet stays in
+// memory until the next append since the document points into it.
+extern "C"
+int simdjson_ffi_parse_body(simdjson_ffi_state *state, const char **errmsg) try {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    auto &body = state->body;
+    size_t len = body.size;
+
+    // the body is left alone as long as it is not empty
+    simdjson_shrink(*state, len);
+
+    // there is no buffer yet if nothing was appended
+    body.reserve(SIMDJSON_PADDING);
+    body.size = 0;
+
+    simdjson_iterate(*state, padded_string_view(body.data.get(), len, len + SIMDJSON_PADDING));
+
+    simdjson_process_value(*state, state->document, state->projection.get());
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->ops_n == 1);
+
+    return simdjson_flush(*state);
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    state->body.size = 0;
+
+    return SIMDJSON_FFI_ERROR;
+
+} catch (std::bad_alloc &) {
+    simdjson_count_error(*state, MEMALLOC);
+    *errmsg = "no memory";
+
+    state->body.size = 0;
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Like `simdjson_ffi_parse()`, but only the value at the JSON Pointer
+// `pointer` is streamed, nothing after it is looked at.
+// Returns 0 if there is no such value.
+extern "C"
+int simdjson_ffi_at_pointer(simdjson_ffi_state *state,
+    const char *json, size_t len, const char *pointer, size_t pointer_len,
+    const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(json);
+    SIMDJSON_DEVELOPMENT_ASSERT(pointer);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    simdjson_shrink(*state, len);
+    simdjson_iterate(*state, json, len);
+
+    auto value = state->document.at_pointer(std::string_view(pointer, pointer_len));
+
+    if (value.error() == NO_SUCH_FIELD || value.error() == INDEX_OUT_OF_BOUNDS) {
+        state->json = padded_string();
+
+        return 0;
+    }
+
+    // the return value is intentionally ignored
+    // because the target could be either a scalar or
+    // array/object
+    simdjson_process_value(*state, value.value());
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->ops_n == 1);
+
+    return simdjson_flush(*state);
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    // clean up tmp string on error to save memory
+    state->json = padded_string();
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// (Re)starts the stream at offset `start` of `stream_buf`.
+static void simdjson_stream_start(simdjson_ffi_state &state, size_t start,
+                                  size_t batch_size) {
+    state.stream_start = start;
+
+    // the buffer is padded at its very end, which is shared by the remainder
+    state.stream = state.parser.iterate_many(state.stream_buf + start,
+                                             state.stream_len - start, batch_size);
+    state.stream_it = state.stream.begin();
+}
+
+
+// Starts decoding `json` as a sequence of whitespace separated documents,
+// e.g. NDJSON. Nothing is parsed until `simdjson_ffi_next_document()`.
+extern "C"
+int simdjson_ffi_parse_many(simdjson_ffi_state *state,
+    const char *json, size_t len, const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(json);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    // the whole buffer, not every document of it
+    simdjson_check_document_size(*state, len);
+    simdjson_shrink(*state, std::min<size_t>(len, ondemand::DEFAULT_BATCH_SIZE));
+
+    state->frames.clear();
+    state->ops_n = 0;
+
+    auto view = get_padded_string_view(*state, json, len);
+
+    // documents are counted as they are decoded
+    state->stats.bytes += len;
+
+    state->stream_buf = view.data();
+    state->stream_len = view.length();
+    state->stream_doc = 0;
+    state->stream_resync = false;
+    state->stream_advance = false;
+    state->stream_line = false;
+
+    simdjson_stream_start(*state, 0, ondemand::DEFAULT_BATCH_SIZE);
+    state->streaming = true;
+
+    return 0;
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    state->streaming = false;
+    state->json = padded_string();
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Restarts the stream at the line after the current document, so one bad
+// record does not take the rest of the buffer down with it.
+// Returns false if there is nothing left.
+static bool simdjson_stream_resync(simdjson_ffi_state &state) {
+    const char *eol = static_cast<const char *>(
+        std::memchr(state.stream_buf + state.stream_doc, '\n',
+                    state.stream_len - state.stream_doc));
+
+    if (eol == nullptr) {
+        return false;
+    }
+
+    simdjson_stream_start(state, eol + 1 - state.stream_buf, ondemand::DEFAULT_BATCH_SIZE);
+
+    return true;
+}
+
+
+// Documents parsed on their own by `simdjson_ffi_next_document()` must span
+// the rest of their line, what follows them would be lost otherwise.
+static void simdjson_stream_check_line(simdjson_ffi_state &state) {
+    if (state.stream_line && !state.document.at_end()) {
+        throw simdjson_error(TRAILING_CONTENT);
+    }
+}
+
+
+// Streams the first op of the next document started by
+// `simdjson_ffi_parse_many()`, the rest of it comes from `simdjson_ffi_next()`.
+// Returns 0 if there are no more documents. After an error, the remainder of
+// the line holding the bad document is skipped by the following call.
+extern "C"
+int simdjson_ffi_next_document(simdjson_ffi_state *state, const char **errmsg) try {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+    SIMDJSON_DEVELOPMENT_ASSERT(state->opcodes.size() == state->batch_size);
+
+    if (!state->streaming) {
+        return 0;
+    }
+
+    state->frames.clear();
+    state->ops_n = 0;
+    state->strings.size = 0;
+
+    bool resync = state->stream_resync;
+
+    if (state->stream_advance) {
+        ++state->stream_it;
+    }
+
+    state->stream_resync = false;
+    state->stream_advance = false;
+    state->stream_line = false;
+
+    bool more = !resync || simdjson_stream_resync(*state);
+
+    if (more && state->stream_it != state->stream.end() &&
+        (*state->stream_it).error() == CAPACITY) {
+
+        // the next document does not fit in a batch, start over from it
+        // with a single batch for the rest of the buffer
+        size_t remaining = state->stream.truncated_bytes();
+
+        simdjson_stream_start(*state, state->stream_len - remaining,
+                              std::max<size_t>(remaining, ondemand::DEFAULT_BATCH_SIZE));
+    }
+
+    if (!more || !(state->stream_it != state->stream.end())) {
+        // stage 1 did not run if a resync found no more lines, nor on an
+        // empty remainder, its results are left over from earlier streams
+        size_t truncated = more && state->stream_start < state->stream_len ?
+                           state->stream.truncated_bytes() : 0;
+
+        state->streaming = false;
+        state->json = padded_string();
+
+        if (truncated > 0) {
+            simdjson_count_error(*state, INCOMPLETE_ARRAY_OR_OBJECT);
+            *errmsg = error_message(INCOMPLETE_ARRAY_OR_OBJECT);
+            return SIMDJSON_FFI_ERROR;
+        }
+
+        return 0;
+    }
+
+    auto doc = *state->stream_it;
+
+    state->stream_doc = state->stream_start + state->stream_it.current_index();
+
+    // the parser reuses its string buffer for every document
+    state->keys.clear();
+    state->values = 0;
+    state->stats.documents++;
+
+    if (doc.error()) {
+        // stage 1 failed for the whole batch (e.g. an unclosed string),
+        // the line could still be fine on its own
+        state->stream_resync = true;
+        state->stream_line = true;
+
+        const char *line = state->stream_buf + state->stream_doc;
+        const char *eol = static_cast<const char *>(
+            std::memchr(line, '\n', state->stream_len - state->stream_doc));
+        size_t len = eol ? eol - line : state->stream_len - state->stream_doc;
+
+        state->document = state->parser.iterate(line, len,
+                              state->stream_len - state->stream_doc + SIMDJSON_PADDING);
+
+        // checking a root null does not move past it, so it can not be
+        // told apart from trailing content
+        if (state->document.type() == ondemand::json_type::null) {
+            state->stream_line = false;
+        }
+
+        simdjson_process_value(*state, state->document, state->projection.get());
+
+    } else {
+        // move on once the document has been fully streamed,
+        // the catch blocks turn this into a resync on errors
+        state->stream_advance = true;
+
+        simdjson_process_value(*state, doc.value_unsafe(), state->projection.get());
+    }
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->ops_n == 1);
+
+    if (state->frames.empty()) {
+        simdjson_stream_check_line(*state);
+    }
+
+    return simdjson_flush(*state);
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    state->stream_resync = true;
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+extern "C"
+int simdjson_ffi_is_eof(simdjson_ffi_state *state) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    return state->document.at_end();
+}
+
+
+// Whether the strings of the batch reached `batch_bytes`, so a batch of
+// large strings is handed over as early as one of many small values.
+static bool simdjson_batch_full(simdjson_ffi_state &state) {
+    return simdjson_unlikely(state.strings.size >= state.batch_bytes);
+}
+
+
+extern "C"
+int simdjson_ffi_next(simdjson_ffi_state *state, const char **errmsg) try {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+    SIMDJSON_DEVELOPMENT_ASSERT(state->opcodes.size() == state->batch_size);
+
+    state->ops_n = 0;
+    state->strings.size = 0;
+
+    while (!state->frames.empty()) {
+
+        if (state->ops_n >= state->opcodes.size() - 1 || simdjson_batch_full(*state)) {
+            // -1 for key value pair which requires 2 ops
+            return simdjson_flush(*state);
+        }
+
+        auto &frame = state->frames.top();
+
+        switch (frame.state) {
+            case simdjson_ffi_resume_state::array: {
+                auto &it = frame.it.array.current;
+
+                if (frame.processing) {
+                    ++it;
+                    frame.processing = false;
+                }
+
+                // resume array iteration
+                for (; it != frame.it.array.end; ++it) {
+                    auto value = *it;
+
+                    // deep arrays were not counted up front
+                    simdjson_check_elements(*state, ++frame.elements);
+
+                    // arrays are transparent to projections, but the projected
+                    // paths go deeper than any scalar element
+                    if (frame.projection) {
+                        ondemand::json_type type = value.type();
+                        if (type != ondemand::json_type::array
+                            && type != ondemand::json_type::object) {
+                            continue;
+                        }
+                    }
+
+                    if (simdjson_process_value(*state, value, frame.projection)) {
+                        // save state, go deeper
+                        frame.processing = true;
+
+                        break;
+                    }
+
+                    if (state->ops_n >= state->opcodes.size() || simdjson_batch_full(*state)) {
+                        // array can use the last of the slots, no need to
+                        // reserve two slots like object below
+                        frame.processing = true;
+
+                        return simdjson_flush(*state);
+                    }
+                }
+
+                break;
+            }
+
+            case simdjson_ffi_resume_state::object: {
+                auto &it = frame.it.object.current;
+
+                if (frame.processing) {
+                    ++it;
+                    frame.processing = false;
+                }
+
+                // resume object iteration
+                for (; it != frame.it.object.end; ++it) {
+                    auto field = *it;
+
+                    // deep or projected objects were not counted up front
+                    simdjson_check_elements(*state, ++frame.elements);
+                    std::string_view key = field.unescaped_key();
+                    const simdjson_ffi_projection *projection = nullptr;
+
+                    if (frame.projection) {
+                        bool skip;
+
+                        projection = simdjson_project_field(*frame.projection,
+                                                            key, field.value(), skip);
+                        if (skip) {
+                            // ondemand skips over the unread value for us
+                            continue;
+                        }
+                    }
+
+                    simdjson_process_key(*state, key);
+
+                    // this can not overflow, because we checked to make sure
+                    // ops has at least 2 empty slots above
+
+                    if (simdjson_process_value(*state, field.value(), projection)) {
+                        // save state, go deeper
+                        frame.processing = true;
+
+                        break;
+                    }
+
+                    if (state->ops_n >= state->opcodes.size() - 1 || simdjson_batch_full(*state)) {
+                        frame.processing = true;
+
+                        return simdjson_flush(*state);
+                    }
+                }
+
+                break;
+            }
+
+            default:
+                SIMDJSON_UNREACHABLE();
+        }
+
+        if (!frame.processing) {
+            state->frames.pop();
+
+            state->opcodes[state->ops_n++] = SIMDJSON_FFI_OPCODE_RETURN;
+        }
+    }
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->frames.empty());
+
+    // we are done! clean up the tmp string to save memory,
+    // unless more documents are coming from it
+    if (!state->streaming) {
+        state->json = padded_string();
+
+    } else {
+        simdjson_stream_check_line(*state);
+    }
+
+    return simdjson_flush(*state);
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    if (state->streaming) {
+        state->stream_resync = true;
+
+        return SIMDJSON_FFI_ERROR;
+    }
+
+    // clean up tmp string on error to save memory
+    state->json = padded_string();
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Appends the ops streamed so far to the `batch_*` arrays, along with
+// their strings which would otherwise be overwritten by the next batch.
+static void simdjson_batch_append(simdjson_ffi_state &state) {
+    auto &strings = state.batch_strings;
+    size_t base = strings.size;
+
+    std::memcpy(strings.reserve(state.strings.size), state.strings.data.get(),
+                state.strings.size);
+    strings.size += state.strings.size;
+
+    for (size_t i = 0; i < state.ops_n; i++) {
+        uint8_t opcode = state.opcodes[i];
+        simdjson_ffi_payload_t payload = state.payloads[i];
+
+        if (opcode == SIMDJSON_FFI_OPCODE_STRING || opcode == SIMDJSON_FFI_OPCODE_KEY) {
+            payload.str.offset += base;
+        }
+
+        state.batch_opcodes.push_back(opcode);
+        state.batch_payloads.push_back(payload);
+    }
+}
+
+
+// Streams a whole document into the `batch_*` arrays,
+// returns the error message if it is invalid.
+static const char *simdjson_batch_document(simdjson_ffi_state &state,
+    const char *json, size_t len) {
+
+    try {
+        simdjson_iterate(state, json, len);
+        simdjson_process_value(state, state.document, state.projection.get());
+
+    } catch (simdjson_error &e) {
+        return simdjson_count_error(state, e);
+    }
+
+    // the following batches are counted by `simdjson_ffi_next()`
+    simdjson_count_ops(state);
+
+    // checking a root null does not move past it, so it can not be told
+    // apart from trailing content, same as `_M:process()` in decoder.lua
+    bool null = state.opcodes[0] == SIMDJSON_FFI_OPCODE_NULL;
+
+    for (;;) {
+        simdjson_batch_append(state);
+
+        if (state.frames.empty()) {
+            break;
+        }
+
+        const char *errmsg;
+
+        if (simdjson_ffi_next(&state, &errmsg) == SIMDJSON_FFI_ERROR) {
+            return errmsg;
+        }
+    }
+
+    if (!null && !state.document.at_end()) {
+        simdjson_count_error(state, TRAILING_CONTENT);
+        return error_message(TRAILING_CONTENT);
+    }
+
+    return nullptr;
+}
+
+
+// Decodes `n` documents with a single call. Their ops are written back to
+// back to `*ops`: every document is either its usual op stream, or a single
+// ERROR op holding the error message if it is invalid.
+// Returns the total number of ops.
+extern "C"
+int simdjson_ffi_parse_batch(simdjson_ffi_state *state,
+    const char **jsons, const size_t *lens, size_t n,
+    const simdjson_ffi_ops_t **ops, const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(jsons || n == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(lens || n == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(ops);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += lens[i];
+    }
+
+    simdjson_shrink(*state, total);
+    simdjson_reserve_ops(*state);
+
+    state->batch_opcodes.clear();
+    state->batch_payloads.clear();
+    state->batch_strings.size = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t ops_mark = state->batch_opcodes.size();
+        size_t strings_mark = state->batch_strings.size;
+
+        const char *err = simdjson_batch_document(*state, jsons[i], lens[i]);
+        if (err) {
+            state->batch_opcodes.resize(ops_mark);
+            state->batch_payloads.resize(ops_mark);
+            state->batch_strings.size = strings_mark;
+
+            simdjson_ffi_payload_t payload;
+            size_t len = std::strlen(err);
+
+            std::memcpy(state->batch_strings.reserve(len), err, len);
+
+            payload.str.offset = state->batch_strings.size;
+            payload.str.len = len;
+
+            state->batch_strings.size += len;
+
+            state->batch_opcodes.push_back(SIMDJSON_FFI_OPCODE_ERROR);
+            state->batch_payloads.push_back(payload);
+        }
+    }
+
+    // clean up tmp string to save memory
+    state->json = padded_string();
+
+    state->batch_ops.opcodes = state->batch_opcodes.data();
+    state->batch_ops.payloads = state->batch_payloads.data();
+    state->batch_ops.strings = state->batch_strings.data.get();
+
+    *ops = &state->batch_ops;
+
+    return state->batch_opcodes.size();
+
+} catch (std::bad_alloc &) {
+    simdjson_count_error(*state, MEMALLOC);
+    *errmsg = "no memory";
+
+    state->json = padded_string();
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Number of elements or fields of the container starting at `tape[i]`,
+// the count stored along with it saturates at 2^24 - 1.
+static size_t simdjson_tape_count(const uint64_t *tape, size_t i) {
+    uint64_t word = tape[i];
+    size_t count = (word >> 32) & internal::JSON_COUNT_MASK;
+
+    if (simdjson_likely(count < internal::JSON_COUNT_MASK)) {
+        return count;
+    }
+
+    // walk the children, skipping over nested containers
+    size_t end = uint32_t(word) - 1;
+    size_t values = 0;
+
+    for (i++; i < end; values++) {
+        char type = tape[i] >> 56;
+
+        if (type == '[' || type == '{') {
+            i = uint32_t(tape[i]);
+
+        } else {
+            i += (type == 'l' || type == 'u' || type == 'd') ? 2 : 1;
+        }
+    }
+
+    // keys and values alternate within objects
+    return char(word >> 56) == '{' ? values / 2 : values;
+}
+
+
+// Same checks as the ondemand engine, done over the finished tape.
+// Returns the error message if a limit was exceeded.
+static const char *simdjson_tape_check_limits(simdjson_ffi_state &state) {
+    const uint64_t *tape = state.dom.doc.tape.get();
+    const uint8_t *strings = state.dom.doc.string_buf.get();
+    const auto &limits = state.limits;
+
+    size_t end = tape[0] & internal::JSON_VALUE_MASK;
+    size_t values = 0;
+    // for every open container, whether it is an object expecting a key next
+    std::vector<char> keys;
+
+    for (size_t i = 1; i < end; i++) {
+        uint64_t word = tape[i];
+        char type = word >> 56;
+
+        if (type == ']' || type == '}') {
+            keys.pop_back();
+            continue;
+        }
+
+        if (type == '"') {
+            uint32_t len;
+            std::memcpy(&len, strings + (word & internal::JSON_VALUE_MASK), sizeof(len));
+
+            if (len > limits.max_string_length) {
+                return "LIMIT_EXCEEDED: A string is longer than max_string_length.";
+            }
+        }
+
+        if (!keys.empty() && keys.back() != 0) {
+            if (keys.back() == 'k') {
+                // the value comes next
+                keys.back() = 'v';
+                continue;
+            }
+
+            keys.back() = 'k';
+        }
+
+        if (++values > limits.max_values) {
+            return "LIMIT_EXCEEDED: The document has more values than max_values.";
+        }
+
+        switch (type) {
+        case '[':
+        case '{':
+            if (simdjson_tape_count(tape, i) > limits.max_elements) {
+                return "LIMIT_EXCEEDED: A container has more elements than max_elements.";
+            }
+
+            keys.push_back(type == '{' ? 'k' : 0);
+            break;
+
+        case 'l':
+        case 'u':
+        case 'd':
+            i++;
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+
+// Parses `json` with the DOM parser, leaving the tape in `state.dom.doc`.
+// Returns the error message if a limit was exceeded, throws on other errors.
+// Nothing but the DOM parser is touched with `dom_only`, e.g. the ondemand
+// parser and copy of the input of a stream being decoded.
+static const char *simdjson_dom_parse(simdjson_ffi_state &state, const char *json, size_t len,
+                                      bool dom_only = false) {
+    simdjson_check_document_size(state, len);
+    simdjson_shrink(state, len, dom_only);
+
+    auto &dom = state.dom;
+
+    // The DOM parser counts the values inside of the innermost container as
+    // a level of their own, so this matches the ondemand engine except
+    // for an empty innermost container, which may go one level deeper
+    size_t max_depth = state.frames.max_depth + 1;
+
+    if (simdjson_unlikely(dom.max_depth() != max_depth)) {
+        error_code err = dom.allocate(std::max(dom.capacity(), len), max_depth);
+        if (err) {
+            throw simdjson_error(err);
+        }
+    }
+
+    state.stats.documents++;
+    state.stats.bytes += len;
+
+    // the tape has its own copy of the strings, the input is not needed afterwards
+    padded_string copy;
+    error_code err = dom.parse(get_padded_string_view(state, json, len, copy)).error();
+
+    if (err) {
+        throw simdjson_error(err);
+    }
+
+    if (state.limits.max_values != SIZE_MAX || state.limits.max_elements != SIZE_MAX ||
+        state.limits.max_string_length != SIZE_MAX) {
+
+        return simdjson_tape_check_limits(state);
+    }
+
+    return nullptr;
+}
+
+
+// Whether `json` might hold the integer `-0`, which the DOM parser turns into
+// a plain 0. Strings such as "-0" make it return true too, which is harmless.
+static bool simdjson_has_negative_zero(const char *json, size_t len) {
+    const char *p = json;
+    const char *end = json + len;
+
+    while ((p = static_cast<const char *>(memmem(p, end - p, "-0", 2)))) {
+        p += 2;
+
+        // "-0.5", "-0e1" are floats, "-01" is no number at all
+        if (p == end || (*p != '.' && *p != 'e' && *p != 'E' && (*p < '0' || *p > '9'))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Parses `json` with the DOM parser in one go, and points `*tape` at the
+// finished tape, valid until the next parse of any kind. Lua can then build
+// the whole document in a single pass, with the exact size of every container.
+// Nothing refers to `json` afterwards.
+// Returns the number of words of the tape, or 0 for documents the DOM parser
+// would decode differently than ondemand, which are left to it: the DOM parser
+// rejects integers beyond 64 bits instead of decoding them as doubles, and
+// drops the sign of `-0`.
+extern "C"
+int simdjson_ffi_parse_tape(simdjson_ffi_state *state,
+    const char *json, size_t len, const simdjson_ffi_tape_t **tape,
+    const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(json);
+    SIMDJSON_DEVELOPMENT_ASSERT(tape);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    if (simdjson_has_negative_zero(json, len)) {
+        return 0;
+    }
+
+    const char *limit = simdjson_dom_parse(*state, json, len);
+    if (limit) {
+        state->stats.limits++;
+        *errmsg = limit;
+        return SIMDJSON_FFI_ERROR;
+    }
+
+    auto &dom = state->dom;
+
+    state->tape.words = dom.doc.tape.get();
+    state->tape.strings = reinterpret_cast<const char *>(dom.doc.string_buf.get());
+
+    *tape = &state->tape;
+
+    return dom.doc.tape[0] & internal::JSON_VALUE_MASK;
+
+} catch (simdjson_error &e) {
+    state->json = padded_string();
+
+    if (e.error() == BIGINT_ERROR) {
+        // counted again by the ondemand engine
+        state->stats.documents--;
+        state->stats.bytes -= len;
+
+        return 0;
+    }
+
+    *errmsg = simdjson_count_error(*state, e);
+
+    return SIMDJSON_FFI_ERROR;
+
+} catch (std::bad_alloc &) {
+    simdjson_count_error(*state, MEMALLOC);
+    *errmsg = "no memory";
+
+    state->json = padded_string();
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Reads all of `value`, so that ondemand validates it, with the same checks
+// as `simdjson_process_value()`. `values` counts the values read so far.
+template<typename T>
+static void simdjson_walk_value(simdjson_ffi_state &state, T&& value,
+    size_t depth, size_t &values) {
+
+    if (simdjson_unlikely(++values > state.limits.max_values)) {
+        throw simdjson_ffi_limit_error(
+            "LIMIT_EXCEEDED: The document has more values than max_values.");
+    }
+
+    switch (value.type()) {
+    case ondemand::json_type::array: {
+        if (simdjson_unlikely(depth > state.frames.max_depth)) {
+            throw simdjson_error(DEPTH_ERROR);
+        }
+
+        size_t n = 0;
+
+        for (auto element : value.get_array()) {
+            simdjson_check_elements(state, ++n);
+            simdjson_walk_value(state, element.value(), depth + 1, values);
+        }
+
+        break;
+    }
+
+    case ondemand::json_type::object: {
+        if (simdjson_unlikely(depth > state.frames.max_depth)) {
+            throw simdjson_error(DEPTH_ERROR);
+        }
+
+        size_t n = 0;
+
+        for (auto field : value.get_object()) {
+            simdjson_check_elements(state, ++n);
+
+            std::string_view key = field.unescaped_key();
+            simdjson_check_string(state, key);
+
+            simdjson_walk_value(state, field.value(), depth + 1, values);
+        }
+
+        break;
+    }
+
+    case ondemand::json_type::number:
+        // integers beyond 64 bits too
+        (void) double(value);
+        break;
+
+    case ondemand::json_type::string:
+        simdjson_check_string(state, value.get_string());
+        break;
+
+    case ondemand::json_type::boolean:
+        (void) bool(value);
+        break;
+
+    case ondemand::json_type::null:
+        if (!value.is_null()) {
+            throw simdjson_error(N_ATOM_ERROR);
+        }
+
+        break;
+
+    default:
+        SIMDJSON_UNREACHABLE();
+    }
+}
+
+
+// Checks that `json` is a single well formed JSON document, valid UTF-8
+// included, within the limits and maximum depth of `state`. Fails on the
+// same documents as the DOM engine, but nothing is handed over to Lua.
+// Only the DOM parser of `state` is used, a stream being decoded with
+// ondemand is left alone.
+extern "C"
+int simdjson_ffi_validate(simdjson_ffi_state *state,
+    const char *json, size_t len, const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(json);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    const char *limit;
+
+    try {
+        limit = simdjson_dom_parse(*state, json, len, true);
+
+    } catch (simdjson_error &e) {
+        if (e.error() != BIGINT_ERROR) {
+            throw;
+        }
+
+        // the DOM parser rejects integers beyond 64 bits, which decode as
+        // doubles, so ondemand reads the whole document instead. It is
+        // rare enough for a parser of its own, unlike the one of `state`
+        ondemand::parser parser;
+        padded_string copy;
+        size_t values = 0;
+
+        error_code err = parser.allocate(len, state->frames.max_depth + 1);
+        if (err) {
+            throw simdjson_error(err);
+        }
+
+        ondemand::document doc = parser.iterate(get_padded_string_view(*state, json, len, copy));
+
+        simdjson_walk_value(*state, doc, 1, values);
+
+        if (!doc.at_end()) {
+            throw simdjson_error(TRAILING_CONTENT);
+        }
+
+        return 0;
+    }
+
+    if (limit) {
+        state->stats.limits++;
+        *errmsg = limit;
+        return SIMDJSON_FFI_ERROR;
+    }
+
+    return 0;
+
+} catch (simdjson_error &e) {
+    *errmsg = simdjson_count_error(*state, e);
+
+    return SIMDJSON_FFI_ERROR;
+
+} catch (std::bad_alloc &) {
+    simdjson_count_error(*state, MEMALLOC);
+    *errmsg = "no memory";
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+#ifdef SIMDJSON_FFI_LUA_API
+
+
+// Thrown by the Lua C API builder for an integer it can not push as is,
+// see `simdjson_lua_decode()`.
+struct simdjson_lua_int64 {};
+
+
+// stack index of the null sentinel passed to `simdjson_lua_decode()`
+#define SIMDJSON_LUA_NULL 3
+// type of cdata in LuaJIT, which its lua.h leaves out
+#define SIMDJSON_LUA_TCDATA 10
+
+
+static int simdjson_lua_size_hint(size_t n) {
+    return static_cast<int>(std::min<size_t>(n, std::numeric_limits<int>::max()));
+}
+
+
+// Pushes `value` onto the Lua stack, building containers as a whole.
+// Same conversions and checks as `simdjson_process_value()`, with the
+// nesting going on the C and Lua stacks instead of `state.frames`.
+template<typename T>
+static void simdjson_lua_push_value(lua_State *L, simdjson_ffi_state &state,
+    T&& value, size_t depth) {
+
+    if (simdjson_unlikely(++state.values > state.limits.max_values)) {
+        throw simdjson_ffi_limit_error(
+            "LIMIT_EXCEEDED: The document has more values than max_values.");
+    }
+
+    switch (value.type()) {
+    case ondemand::json_type::array: {
+        ondemand::array a = value;
+        size_t elements = 0;
+
+        // a C function gets a few thousand stack slots at most
+        if (simdjson_unlikely(depth > state.frames.max_depth || !lua_checkstack(L, 3))) {
+            throw simdjson_error(DEPTH_ERROR);
+        }
+
+        if (simdjson_unlikely(depth > state.frames.peak)) {
+            state.frames.peak = depth;
+        }
+
+        // only the outermost containers are counted, same as
+        // `simdjson_process_value()`
+        if (depth <= SIMDJSON_FFI_COUNT_DEPTH) {
+            elements = a.count_elements();
+
+            simdjson_check_elements(state, elements);
+        }
+
+        lua_createtable(L, simdjson_lua_size_hint(elements), 0);
+
+        size_t n = 0;
+
+        for (auto element : a) {
+            simdjson_check_elements(state, ++n);
+
+            simdjson_lua_push_value(L, state, element, depth + 1);
+            lua_rawseti(L, -2, static_cast<int>(n));
+        }
+
+        break;
+    }
+
+    case ondemand::json_type::object: {
+        ondemand::object o = value;
+        size_t fields = 0;
+
+        if (simdjson_unlikely(depth > state.frames.max_depth || !lua_checkstack(L, 4))) {
+            throw simdjson_error(DEPTH_ERROR);
+        }
+
+        if (simdjson_unlikely(depth > state.frames.peak)) {
+            state.frames.peak = depth;
+        }
+
+        if (depth <= SIMDJSON_FFI_COUNT_DEPTH) {
+            fields = o.count_fields();
+
+            simdjson_check_elements(state, fields);
+        }
+
+        lua_createtable(L, 0, simdjson_lua_size_hint(fields));
+
+        size_t n = 0;
+
+        for (auto field : o) {
+            simdjson_check_elements(state, ++n);
+
+            std::string_view key = field.unescaped_key();
+
+            simdjson_check_string(state, key);
+
+            lua_pushlstring(L, key.data(), key.size());
+            simdjson_lua_push_value(L, state, field.value(), depth + 1);
+            lua_rawset(L, -3);
+        }
+
+        break;
+    }
+
+    case ondemand::json_type::number: {
+        switch (value.get_number_type()) {
+        case ondemand::number_type::signed_integer: {
+            int64_t i = value.get_int64();
+
+            if (state.int64 && (i > SIMDJSON_FFI_MAX_SAFE_INTEGER ||
+                                i < -SIMDJSON_FFI_MAX_SAFE_INTEGER)) {
+                throw simdjson_lua_int64();
+            }
+
+            // "-0" is an integer too, but only the float parser keeps its sign
+            lua_pushnumber(L, i != 0 ? static_cast<double>(i) : double(value));
+
+            break;
+        }
+
+        case ondemand::number_type::unsigned_integer: {
+            // always beyond INT64_MAX
+            uint64_t u = value.get_uint64();
+
+            if (state.int64) {
+                throw simdjson_lua_int64();
+            }
+
+            lua_pushnumber(L, static_cast<double>(u));
+
+            break;
+        }
+
+        default:
+            lua_pushnumber(L, double(value));
+        }
+
+        break;
+    }
+
+    case ondemand::json_type::string: {
+        std::string_view str = value.get_string();
+
+        simdjson_check_string(state, str);
+
+        lua_pushlstring(L, str.data(), str.size());
+
+        break;
+    }
+
+    case ondemand::json_type::boolean:
+        lua_pushboolean(L, bool(value));
+        break;
+
+    case ondemand::json_type::null:
+        SIMDJSON_DEVELOPMENT_ASSERT(value.is_null());
+
+        lua_pushvalue(L, SIMDJSON_LUA_NULL);
+        break;
+
+    default:
+        SIMDJSON_UNREACHABLE();
+    }
+}
+
+
+// decode(state, json, null), `state` is the `simdjson_ffi_state *` cdata
+// of the decoder and `null` is pushed for JSON nulls.
+// Returns the decoded value, or nil and the error message, or nothing if
+// the document has an integer which needs to be decoded as int64 cdata,
+// which only the FFI can create.
+static int simdjson_lua_decode(lua_State *L) {
+    // unlike a number, a cdata can not be made up from any address
+    // without the FFI, which can crash the process anyway
+    luaL_argcheck(L, lua_type(L, 1) == SIMDJSON_LUA_TCDATA, 1, "cdata expected");
+
+    auto state = *static_cast<simdjson_ffi_state *const *>(lua_topointer(L, 1));
+
+    luaL_argcheck(L, state != nullptr, 1, "NULL state");
+
+    size_t len;
+    const char *json = luaL_checklstring(L, 2, &len);
+
+    luaL_checkany(L, SIMDJSON_LUA_NULL);
+    lua_settop(L, SIMDJSON_LUA_NULL);
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    const char *errmsg;
+
+    try {
+        simdjson_shrink(*state, len);
+        simdjson_iterate(*state, json, len);
+
+        bool null = state->document.type() == ondemand::json_type::null;
+
+        simdjson_lua_push_value(L, *state, state->document, 1);
+
+        if (!null && !state->document.at_end()) {
+            simdjson_count_error(*state, TRAILING_CONTENT);
+            errmsg = "trailing content found";
+
+        } else {
+            state->json = padded_string();
+
+            return 1;
+        }
+
+    } catch (simdjson_error &e) {
+        errmsg = simdjson_count_error(*state, e);
+
+    } catch (simdjson_lua_int64 &) {
+        state->json = padded_string();
+
+        // counted again by the ondemand engine
+        state->stats.documents--;
+        state->stats.bytes -= len;
+
+        return 0;
+
+    } catch (std::bad_alloc &) {
+        simdjson_count_error(*state, MEMALLOC);
+        errmsg = "no memory";
+    }
+
+    // clean up tmp string on error to save memory
+    state->json = padded_string();
+
+    lua_settop(L, SIMDJSON_LUA_NULL);
+    lua_pushnil(L);
+    lua_pushstring(L, errmsg);
+
+    return 2;
+}
+
+
+// Loaded by cdefs.lua as the "resty.simdjson.capi" module, which builds
+// documents with the Lua C API instead of streaming ops through the FFI.
+extern "C"
+int luaopen_resty_simdjson_capi(lua_State *L) {
+    static const luaL_Reg funcs[] = {
+        { "decode", simdjson_lua_decode },
+        { NULL, NULL }
+    };
+
+    lua_createtable(L, 0, 1);
+    luaL_register(L, NULL, funcs);
+
+    return 1;
+}
+
+
+#endif /* SIMDJSON_FFI_LUA_API */
+
+
+// Same escaping rules as `ESCAPE_TABLE` in encoder.lua,
+// 0 means the byte can be copied as is.
+static const char SIMDJSON_FFI_ESCAPE[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0,   0,   '"', 0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   '/',
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   '\\', 0,  0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   'u',
+    // 0x80 - 0xff are all zeros
+};
+
+
+static inline size_t simdjson_escape_scan_scalar(const char *str, size_t i, size_t len) {
+    for (; i < len; i++) {
+        if (SIMDJSON_FFI_ESCAPE[static_cast<unsigned char>(str[i])]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+// Kernels below return the length of the longest prefix of `str`
+// that can be copied to the output without any escaping.
+typedef size_t (*simdjson_ffi_escape_scan_t)(const char *str, size_t len);
+
+
+static size_t simdjson_escape_scan_swar(const char *str, size_t len) {
+    constexpr uint64_t ONES = 0x0101010101010101ULL;
+    constexpr uint64_t HIGHS = 0x8080808080808080ULL;
+
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, str + i, sizeof(v));
+
+        // any byte < 0x20, then any byte equals to '"', '/', '\\' or 0x7f,
+        // see "Determine if a word has a byte less than n" in Bit Twiddling Hacks
+        uint64_t quote = v ^ (ONES * '"');
+        uint64_t slash = v ^ (ONES * '/');
+        uint64_t backslash = v ^ (ONES * '\\');
+        uint64_t del = v ^ (ONES * 0x7f);
+
+        uint64_t hit = ((v - ONES * 0x20) & ~v) |
+                       ((quote - ONES) & ~quote) |
+                       ((slash - ONES) & ~slash) |
+                       ((backslash - ONES) & ~backslash) |
+                       ((del - ONES) & ~del);
+
+        if (hit & HIGHS) {
+            // let the scalar loop find out the exact position
+            break;
+        }
+    }
+
+    return simdjson_escape_scan_scalar(str, i, len);
+}
+
+
+#if SIMDJSON_IS_X86_64
+static size_t simdjson_escape_scan_sse2(const char *str, size_t len) {
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(str + i));
+
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v),
+                         _mm_cmpeq_epi8(v, quote)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, slash),
+                                      _mm_cmpeq_epi8(v, backslash)),
+                         _mm_cmpeq_epi8(v, del)));
+
+        uint32_t bits = _mm_movemask_epi8(m);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+
+    return simdjson_escape_scan_scalar(str, i, len);
+}
+
+
+__attribute__((target("avx2")))
+static inline uint32_t simdjson_escape_mask_avx2(__m256i v) {
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v),
+                        _mm256_cmpeq_epi8(v, quote)),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, slash),
+                                        _mm256_cmpeq_epi8(v, backslash)),
+                        _mm256_cmpeq_epi8(v, del)));
+
+    return _mm256_movemask_epi8(m);
+}
+
+
+__attribute__((target("avx2")))
+static size_t simdjson_escape_scan_avx2(const char *str, size_t len) {
+    size_t i = 0;
+
+    // 64 bytes per iteration, the common case of long clean runs
+    for (; i + 64 <= len; i += 64) {
+        uint64_t lo = simdjson_escape_mask_avx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + i)));
+        uint64_t hi = simdjson_escape_mask_avx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + i + 32)));
+
+        uint64_t bits = lo | (hi << 32);
+        if (bits) {
+            return i + __builtin_ctzll(bits);
+        }
+    }
+
+    for (; i + 32 <= len; i += 32) {
+        uint32_t bits = simdjson_escape_mask_avx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(str + i)));
+
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+
+    return simdjson_escape_scan_scalar(str, i, len);
+}
+#endif /* SIMDJSON_IS_X86_64 */
+
+
+#if SIMDJSON_IS_ARM64
+static size_t simdjson_escape_scan_neon(const char *str, size_t len) {
+    const uint8x16_t ctrl = vdupq_n_u8(0x1f);
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t slash = vdupq_n_u8('/');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(str + i));
+
+        uint8x16_t m = vorrq_u8(
+            vorrq_u8(vcleq_u8(v, ctrl), vceqq_u8(v, quote)),
+            vorrq_u8(vorrq_u8(vceqq_u8(v, slash), vceqq_u8(v, backslash)),
+                     vceqq_u8(v, del)));
+
+        // narrow every byte of the mask into a nibble
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (bits) {
+            return i + (__builtin_ctzll(bits) >> 2);
+        }
+    }
+
+    return simdjson_escape_scan_scalar(str, i, len);
+}
+#endif /* SIMDJSON_IS_ARM64 */
+
+
+// Follow the kernel simdjson itself picked for this CPU
+// (honoring `SIMDJSON_FORCE_IMPLEMENTATION` as well),
+// so we never run instructions simdjson decided not to use.
+static simdjson_ffi_escape_scan_t simdjson_escape_scan_select() {
+    const std::string name = get_active_implementation()->name();
+
+#if SIMDJSON_IS_X86_64
+    if (name == "icelake" || name == "haswell") {
+        return simdjson_escape_scan_avx2;
+    }
+
+    if (name == "westmere") {
+        return simdjson_escape_scan_sse2;
+    }
+#endif
+
+#if SIMDJSON_IS_ARM64
+    if (name == "arm64") {
+        return simdjson_escape_scan_neon;
+    }
+#endif
+
+    return simdjson_escape_scan_swar;
+}
+
+
+static size_t simdjson_escape_scan(const char *str, size_t len) {
+    static const simdjson_ffi_escape_scan_t scan = simdjson_escape_scan_select();
+
+    return scan(str, len);
+}
+
+
+// `out` must have room for at least `len * 6` bytes,
+// returns the number of bytes written.
+static size_t simdjson_escape_string(const char *str, size_t len, char *out) {
+    static const char HEX[] = "0123456789abcdef";
+
+    char *p = out;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t clean = simdjson_escape_scan(str + i, len - i);
+
+        std::memcpy(p, str + i, clean);
+        p += clean;
+        i += clean;
+
+        if (i == len) {
+            break;
+        }
+
+        unsigned char c = str[i++];
+        char e = SIMDJSON_FFI_ESCAPE[c];
+
+        SIMDJSON_DEVELOPMENT_ASSERT(e != 0);
+
+        *p++ = '\\';
+        *p++ = e;
+
+        if (e == 'u') {
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = HEX[c >> 4];
+            *p++ = HEX[c & 0xf];
+        }
+    }
+
+    return p - out;
+}
+
+
+// Escapes `str` in chunks, so the buffer never needs more than 6 times
+// a chunk of room past the output, however long the string.
+static void simdjson_encode_string(simdjson_ffi_buffer &buf, const char *str, size_t len) {
+    *buf.reserve(1) = '"';
+    buf.size++;
+
+    while (len > 0) {
+        size_t n = std::min<size_t>(len, SIMDJSON_FFI_ESCAPE_CHUNK);
+
+        buf.size += simdjson_escape_string(str, n, buf.reserve(n * 6 + 1));
+
+        str += n;
+        len -= n;
+    }
+
+    *buf.reserve(1) = '"';
+    buf.size++;
+}
+
+
+// Writes the decimal digits of `u`, preceded by a '-' if `negative`.
+static size_t simdjson_format_integer(uint64_t u, bool negative, char *out) {
+    char tmp[24];
+    char *end = tmp + sizeof(tmp);
+    char *p = end;
+
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u);
+
+    if (negative) {
+        *--p = '-';
+    }
+
+    std::memcpy(out, p, end - p);
+
+    return end - p;
+}
+
+
+// Formats `number` into `out`, which must have room for at least
+// `SIMDJSON_FFI_NUMBER_BUF_SIZE` bytes, returns the number of bytes written.
+//
+// `precision` 0 picks the shortest representation that round trips,
+// 1 - 16 behaves exactly like `string.format("%.<precision>g")`.
+static size_t simdjson_format_number(double number, int precision, char *out) {
+    static const uint64_t POW10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    };
+
+    // integers which are exact in a double take the fast path,
+    // -0.0 is left to the slow path to keep its sign
+    if (number >= -9007199254740992.0 && number <= 9007199254740992.0 &&
+        number == static_cast<double>(static_cast<int64_t>(number)) &&
+        (number != 0 || !std::signbit(number))) {
+
+        int64_t i = static_cast<int64_t>(number);
+        uint64_t u = i < 0 ? 0 - static_cast<uint64_t>(i) : i;
+
+        // "%.<precision>g" switches to the exponent form beyond `precision` digits
+        if (precision == 0 || u < POW10[precision]) {
+            return simdjson_format_integer(u, i < 0, out);
+        }
+    }
+
+    // `to_chars()` would print -0.0 as "-0.0"
+    if (precision == 0 && std::isfinite(number) && number != 0) {
+        // Grisu2, shipped with simdjson for its own serializer
+        return internal::to_chars(out, out + SIMDJSON_FFI_NUMBER_BUF_SIZE, number) - out;
+    }
+
+    // fixed precision, -0.0, inf and nan
+    return snprintf(out, SIMDJSON_FFI_NUMBER_BUF_SIZE, "%.*g",
+                    precision ? precision : 17, number);
+}
+
+
+static void simdjson_encode_number(simdjson_ffi_buffer &buf, double number, int precision) {
+    buf.size += simdjson_format_number(number, precision,
+                                       buf.reserve(SIMDJSON_FFI_NUMBER_BUF_SIZE));
+}
+
+
+static void simdjson_encode_int64(simdjson_ffi_buffer &buf, int64_t i) {
+    uint64_t u = i < 0 ? 0 - static_cast<uint64_t>(i) : i;
+
+    buf.size += simdjson_format_integer(u, i < 0, buf.reserve(SIMDJSON_FFI_NUMBER_BUF_SIZE));
+}
+
+
+static void simdjson_encode_uint64(simdjson_ffi_buffer &buf, uint64_t u) {
+    buf.size += simdjson_format_integer(u, false, buf.reserve(SIMDJSON_FFI_NUMBER_BUF_SIZE));
+}
+
+
+static void simdjson_encode_literal(simdjson_ffi_buffer &buf, const char *lit, size_t len) {
+    std::memcpy(buf.reserve(len), lit, len);
+    buf.size += len;
+}
+
+
+// `out` must have room for at least `len * 6` bytes, returns the number
+// of bytes written, which equals to `len` when nothing needed escaping.
+extern "C"
+size_t simdjson_ffi_escape_string(const char *str, size_t len, char *out) {
+    SIMDJSON_DEVELOPMENT_ASSERT(str || len == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(out || len == 0);
+
+    return simdjson_escape_string(str, len, out);
+}
+
+
+// `out` must have room for at least `SIMDJSON_FFI_NUMBER_BUF_SIZE` bytes,
+// returns the number of bytes written.
+extern "C"
+int simdjson_ffi_format_number(double number, int precision, char *out) {
+    SIMDJSON_DEVELOPMENT_ASSERT(precision >= 0 && precision <= 16);
+    SIMDJSON_DEVELOPMENT_ASSERT(out);
+
+    return simdjson_format_number(number, precision, out);
+}
+
+
+// Same as `simdjson_ffi_format_number()`, but exact for every 64 bit integer.
+extern "C"
+int simdjson_ffi_format_int64(int64_t number, char *out) {
+    SIMDJSON_DEVELOPMENT_ASSERT(out);
+
+    uint64_t u = number < 0 ? 0 - static_cast<uint64_t>(number) : number;
+
+    return simdjson_format_integer(u, number < 0, out);
+}
+
+
+extern "C"
+int simdjson_ffi_format_uint64(uint64_t number, char *out) {
+    SIMDJSON_DEVELOPMENT_ASSERT(out);
+
+    return simdjson_format_integer(number, false, out);
+}
+
+
+extern "C"
+simdjson_ffi_encoder_state *simdjson_ffi_encoder_state_new() {
+    auto state = new(std::nothrow) simdjson_ffi_encoder_state();
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    return state;
+}
+
+
+extern "C"
+simdjson_ffi_op_t *simdjson_ffi_encoder_state_get_ops(simdjson_ffi_encoder_state *state) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    state->ops.resize(SIMDJSON_FFI_BATCH_SIZE);
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state->ops.size() == SIMDJSON_FFI_BATCH_SIZE);
+
+    return state->ops.data();
+}
+
+
+extern "C"
+void simdjson_ffi_encoder_state_set_precision(simdjson_ffi_encoder_state *state, int precision) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(precision >= 0 && precision <= 16);
+
+    state->precision = precision;
+}
+
+
+extern "C"
+void simdjson_ffi_encoder_state_reset(simdjson_ffi_encoder_state *state) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    state->frames.clear();
+    state->buf.size = 0;
+
+    // do not hold on to the output of an unusually large encode
+    if (state->buf.capacity > SIMDJSON_FFI_ENCODER_KEEP) {
+        state->buf = simdjson_ffi_buffer();
+    }
+}
+
+
+extern "C"
+void simdjson_ffi_encoder_state_free(simdjson_ffi_encoder_state *state) {
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+
+    delete state;
+}
+
+
+// Serializes the first `n` ops of the batch returned by
+// `simdjson_ffi_encoder_state_get_ops()` into the output buffer.
+//
+// The op stream is the one produced by `simdjson_ffi_next()`, run in reverse:
+// ARRAY/OBJECT open a container, RETURN closes the innermost one, and inside
+// an object every value is preceded by a STRING op holding its key.
+// Containers may span over any number of batches.
+extern "C"
+int simdjson_ffi_encode(simdjson_ffi_encoder_state *state, size_t n,
+    const char **errmsg) try {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+    SIMDJSON_DEVELOPMENT_ASSERT(n <= state->ops.size());
+
+    auto &buf = state->buf;
+
+    for (size_t i = 0; i < n; i++) {
+        const auto &op = state->ops[i];
+
+        if (op.opcode == SIMDJSON_FFI_OPCODE_RETURN) {
+            if (simdjson_unlikely(state->frames.empty())) {
+                *errmsg = "unbalanced container close";
+                return SIMDJSON_FFI_ERROR;
+            }
+
+            auto &frame = state->frames.back();
+
+            if (frame.object) {
+                if (simdjson_unlikely(frame.n % 2 != 0)) {
+                    *errmsg = "object key without value";
+                    return SIMDJSON_FFI_ERROR;
+                }
+
+                *buf.reserve(1) = '}';
+
+            } else {
+                *buf.reserve(1) = ']';
+            }
+
+            buf.size++;
+            state->frames.pop_back();
+
+            continue;
+        }
+
+        if (!state->frames.empty()) {
+            auto &frame = state->frames.back();
+
+            if (frame.object && frame.n % 2 == 0) {
+                if (simdjson_unlikely(op.opcode != SIMDJSON_FFI_OPCODE_STRING)) {
+                    *errmsg = "object key must be a string";
+                    return SIMDJSON_FFI_ERROR;
+                }
+
+                if (frame.n > 0) {
+                    *buf.reserve(1) = ',';
+                    buf.size++;
+                }
+
+                simdjson_encode_string(buf, op.val.str, op.size);
+
+                *buf.reserve(1) = ':';
+                buf.size++;
+
+                frame.n++;
+
+                continue;
+            }
+
+            if (!frame.object && frame.n > 0) {
+                *buf.reserve(1) = ',';
+                buf.size++;
+            }
+
+            frame.n++;
+        }
+
+        switch (op.opcode) {
+            case SIMDJSON_FFI_OPCODE_ARRAY:
+                *buf.reserve(1) = '[';
+                buf.size++;
+                state->frames.emplace_back(false);
+                break;
+
+            case SIMDJSON_FFI_OPCODE_OBJECT:
+                *buf.reserve(1) = '{';
+                buf.size++;
+                state->frames.emplace_back(true);
+                break;
+
+            case SIMDJSON_FFI_OPCODE_NUMBER:
+                simdjson_encode_number(buf, op.val.number, state->precision);
+                break;
+
+            case SIMDJSON_FFI_OPCODE_INT64:
+                simdjson_encode_int64(buf, op.val.i64);
+                break;
+
+            case SIMDJSON_FFI_OPCODE_UINT64:
+                simdjson_encode_uint64(buf, op.val.u64);
+                break;
+
+            case SIMDJSON_FFI_OPCODE_STRING:
+                simdjson_encode_string(buf, op.val.str, op.size);
+                break;
+
+            case SIMDJSON_FFI_OPCODE_BOOLEAN:
+                if (op.val.boolean) {
+                    simdjson_encode_literal(buf, "true", 4);
+
+                } else {
+                    simdjson_encode_literal(buf, "false", 5);
+                }
+
+                break;
+
+            case SIMDJSON_FFI_OPCODE_NULL:
+                simdjson_encode_literal(buf, "null", 4);
+                break;
+
+            default:
+                *errmsg = "unknown opcode";
+                return SIMDJSON_FFI_ERROR;
+        }
+    }
+
+    return 0;
+
+} catch (std::bad_alloc &e) {
+    *errmsg = "no memory";
+
+    return SIMDJSON_FFI_ERROR;
+}
+
+
+// Returns the serialized JSON and stores its length into `len`,
+// the result stays valid until the next `simdjson_ffi_encoder_state_reset()`.
+extern "C"
+const char *simdjson_ffi_encode_finish(simdjson_ffi_encoder_state *state,
+    size_t *len, const char **errmsg) {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(state);
+    SIMDJSON_DEVELOPMENT_ASSERT(len);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    if (simdjson_unlikely(!state->frames.empty())) {
+        *errmsg = "unclosed container";
+        return nullptr;
+    }
+
+    *len = state->buf.size;
+
+    return state->buf.data.get();
+}
+
+
+// Removes the whitespace between the tokens of `json`, with the minify kernel
+// picked for this CPU at runtime. `out` must have room for `len` bytes, the
+// size of the result is stored into `out_len`. The input is not validated,
+// only unterminated strings are reported.
+extern "C"
+int simdjson_ffi_minify(const char *json, size_t len, char *out, size_t *out_len,
+    const char **errmsg) {
+
+    SIMDJSON_DEVELOPMENT_ASSERT(json || len == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(out || len == 0);
+    SIMDJSON_DEVELOPMENT_ASSERT(out_len);
+    SIMDJSON_DEVELOPMENT_ASSERT(errmsg);
+
+    error_code err = minify(json, len, out, *out_len);
+    if (err) {
+        *errmsg = error_message(err);
+        return SIMDJSON_FFI_ERROR;
+    }
+
+    return 0;
+}
+
+
+// Returns 1 if `len` bytes at `str` are valid UTF-8, 0 otherwise,
+// with the kernel picked for this CPU at runtime.
+extern "C"
+int simdjson_ffi_validate_utf8(const char *str, size_t len) {
+    SIMDJSON_DEVELOPMENT_ASSERT(str || len == 0);
+
+    return validate_utf8(str, len);
+}
+
+
+// Monotonic time in microseconds, for the yield budget of the Lua side.
+// steady_clock is read from the vDSO, usually off the TSC, without a syscall.
+extern "C"
+double simdjson_ffi_clock() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+    return std::chrono::duration<double, std::micro>(now).count();
+}
@@ -3,13 +3,43 @@
 
 
 #include <unistd.h>
-#include <stack>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <vector>
 #include <limits>
+#include <memory>
+#include <map>
+#include <string>
+#include <chrono>
 
 
-#define SIMDJSON_FFI_BATCH_SIZE 2048
-#define SIMDJSON_FFI_ERROR      -1
+#define SIMDJSON_FFI_BATCH_SIZE       2048
+// smallest decoder batch, `simdjson_ffi_next()` needs room for a key value pair
+#define SIMDJSON_FFI_MIN_BATCH_SIZE   2
+#define SIMDJSON_FFI_MAX_BATCH_SIZE   (1 << 20)
+// bytes of strings per decoder batch, beyond which it is handed to Lua early
+#define SIMDJSON_FFI_BATCH_BYTES      (1 << 20)
+// default nesting limit of decoded documents, same as simdjson's own
+#define SIMDJSON_FFI_MAX_DEPTH        1024
+// largest nesting limit that can be configured
+#define SIMDJSON_FFI_MAX_DEPTH_LIMIT  (1 << 16)
+// arrays and objects nested up to this deep are counted to size their tables
+#define SIMDJSON_FFI_COUNT_DEPTH      3
+#define SIMDJSON_FFI_ERROR            -1
+// number of recent document sizes the shrink policy takes the median of
+#define SIMDJSON_FFI_SHRINK_WINDOW    16
+// 2^53, integers up to this magnitude are exact in a double
+#define SIMDJSON_FFI_MAX_SAFE_INTEGER 9007199254740992LL
+// longest output of `simdjson_ffi_format_number()`, e.g. "-2.2250738585072014e-308"
+#define SIMDJSON_FFI_NUMBER_BUF_SIZE  32
+// strings are escaped this many bytes at a time, see `simdjson_encode_string()`
+#define SIMDJSON_FFI_ESCAPE_CHUNK     (64 * 1024)
+// encoder buffers beyond this size are released after every encode
+#define SIMDJSON_FFI_ENCODER_KEEP     (1 << 20)
+// number of opcodes, and room for every `simdjson::error_code` in the stats
+#define SIMDJSON_FFI_OPCODES          12
+#define SIMDJSON_FFI_ERROR_CODES      64
 
 
 extern "C" {
@@ -20,10 +50,16 @@ extern "C" {
         SIMDJSON_FFI_OPCODE_STRING,
         SIMDJSON_FFI_OPCODE_BOOLEAN,
         SIMDJSON_FFI_OPCODE_NULL,
-        SIMDJSON_FFI_OPCODE_RETURN
+        SIMDJSON_FFI_OPCODE_RETURN,
+        SIMDJSON_FFI_OPCODE_ERROR,
+        SIMDJSON_FFI_OPCODE_INT64,
+        SIMDJSON_FFI_OPCODE_UINT64,
+        SIMDJSON_FFI_OPCODE_KEY,
+        SIMDJSON_FFI_OPCODE_KEY_ID
     } simdjson_ffi_opcode_e;
 
 
+    // Used by the encoder, Lua fills these in
     typedef struct {
         simdjson_ffi_opcode_e      opcode;
         uint32_t                   size;
@@ -31,9 +67,98 @@ extern "C" {
         union {
             const char            *str;
             double                 number;
+            int64_t                i64;
+            uint64_t               u64;
             uint32_t               boolean;
         }                          val;
     } simdjson_ffi_op_t;
+
+
+    typedef union {
+        double                     number;
+        int64_t                    i64;
+        uint64_t                   u64;
+        uint32_t                   boolean;
+        // ARRAY/OBJECT: number of elements or fields, or an upper bound of it,
+        // KEY_ID: id of the key
+        uint32_t                   size;
+        // STRING/KEY/ERROR: `len` bytes at `offset` of the string arena
+        struct {
+            uint32_t               offset;
+            uint32_t               len;
+        }                          str;
+    } simdjson_ffi_payload_t;
+
+
+    // Ops produced by the decoder, as a struct of arrays so the Lua
+    // loop scans dense opcodes: the i-th op is `opcodes[i]` with
+    // `payloads[i]`. `strings` is only valid until the next batch.
+    typedef struct {
+        const uint8_t                 *opcodes;
+        const simdjson_ffi_payload_t  *payloads;
+        const char                    *strings;
+    } simdjson_ffi_ops_t;
+
+
+    // The tape of a document parsed by `simdjson_ffi_parse_tape()`, as laid
+    // out by `simdjson::dom`: a root word, then one word per value and one
+    // per container end, with numbers taking an extra word. See
+    // https://github.com/simdjson/simdjson/blob/master/doc/tape.md
+    typedef struct {
+        const uint64_t                *words;
+        // every string is prefixed with its uint32_t length
+        const char                    *strings;
+    } simdjson_ffi_tape_t;
+
+
+    // Passed to `simdjson_ffi_state_set_limits()`, 0 means unlimited
+    typedef struct {
+        // bytes of JSON text
+        size_t                        max_document_size;
+        // elements of an array or fields of an object
+        size_t                        max_elements;
+        // values of a document, counting containers and scalars alike
+        size_t                        max_values;
+        // bytes of an unescaped string or key
+        size_t                        max_string_length;
+    } simdjson_ffi_limits_t;
+
+
+    // Filled in by `simdjson_ffi_state_memory()`, all in bytes
+    typedef struct {
+        // largest document the parser can take without growing
+        size_t                        capacity;
+        // the parser's unescaped string buffer
+        size_t                        string_buf;
+        // op batches, string arenas, frames and the key table
+        size_t                        ops;
+        // padded copy of the document being decoded, if one was needed
+        size_t                        copy;
+        // largest document the DOM parser can take without growing
+        size_t                        dom_capacity;
+        // buffer bodies are appended into by `simdjson_ffi_append()`
+        size_t                        body;
+    } simdjson_ffi_memory_t;
+
+
+    // Filled in by `simdjson_ffi_state_stats()`, counted since the state
+    // was created
+    typedef struct {
+        // documents parsed by any engine, and their bytes of JSON text
+        uint64_t                      documents;
+        uint64_t                      bytes;
+        // bytes copied because they ended too close to a page boundary
+        uint64_t                      copied;
+        // batches of ops streamed by `simdjson_ffi_next()` and the
+        // parse functions, and the ops in them by opcode
+        uint64_t                      batches;
+        uint64_t                      ops[SIMDJSON_FFI_OPCODES];
+        // errors by `simdjson::error_code`, and documents exceeding a limit
+        uint64_t                      errors[SIMDJSON_FFI_ERROR_CODES];
+        uint64_t                      limits;
+        // deepest nesting of arrays and objects decoded
+        uint64_t                      max_depth;
+    } simdjson_ffi_stats_t;
 }
 
 
@@ -50,12 +175,24 @@ static_assert(sizeof(simdjson_ffi_opcode_e) <= 4,
 static_assert(sizeof(simdjson_ffi_op_t) == 16,
               "simdjson_ffi_op_t should be 16 bytes");
 
+static_assert(sizeof(simdjson_ffi_payload_t) == 8,
+              "simdjson_ffi_payload_t should be 8 bytes");
+
+static_assert(SIMDJSON_FFI_OPCODE_KEY_ID <= std::numeric_limits<uint8_t>::max(),
+              "opcodes should fit in uint8_t");
+
+static_assert(SIMDJSON_FFI_OPCODE_KEY_ID + 1 == SIMDJSON_FFI_OPCODES,
+              "SIMDJSON_FFI_OPCODES should be the number of opcodes");
+
+static_assert(simdjson::NUM_ERROR_CODES <= SIMDJSON_FFI_ERROR_CODES,
+              "simdjson error codes should fit in simdjson_ffi_stats_t");
+
 // If the `SIMDJSON_FFI_BATCH_SIZE` is larger than 2^32,
 // we might get a float number in LuaJIT.
 // The design goal of this library doesn't need such a large batch,
 // so this assertion is just in case.
-static_assert(SIMDJSON_FFI_BATCH_SIZE <= std::numeric_limits<uint32_t>::max(),
-              "SIMDJSON_FFI_BATCH_SIZE should be less than 2^32");
+static_assert(SIMDJSON_FFI_MAX_BATCH_SIZE <= std::numeric_limits<uint32_t>::max(),
+              "SIMDJSON_FFI_MAX_BATCH_SIZE should be less than 2^32");
 
 
 enum class simdjson_ffi_resume_state : unsigned char {
@@ -64,9 +201,40 @@ enum class simdjson_ffi_resume_state : unsigned char {
 };
 
 
+// Thrown when a document exceeds one of the limits set by
+// `simdjson_ffi_state_set_limits()`, so it takes the same error paths as
+// simdjson's own errors with a message of its own.
+class simdjson_ffi_limit_error : public simdjson::simdjson_error {
+public:
+    explicit simdjson_ffi_limit_error(const char *msg) noexcept:
+        simdjson_error(simdjson::CAPACITY), msg(msg) {}
+
+    const char *what() const noexcept override { return msg; }
+
+private:
+    const char *msg;
+};
+
+
+// A node of the projection trie, built from the paths passed to
+// `simdjson_ffi_state_set_projection()`. Only object fields found in
+// `fields` are streamed, and a node with `all` set keeps the whole subtree.
+struct simdjson_ffi_projection {
+    bool                                                       all = false;
+    std::map<std::string,
+             std::unique_ptr<simdjson_ffi_projection>,
+             std::less<>>                                      fields;
+};
+
+
 struct simdjson_ffi_stack_frame {
     simdjson_ffi_resume_state       state;
     bool                            processing = false;
+    // elements or fields iterated so far, checked against `max_elements`
+    size_t                          elements = 0;
+
+    // nullptr if nothing is projected out of this container
+    const simdjson_ffi_projection  *projection;
 
     union it {
         template<typename Iter>
@@ -74,35 +242,276 @@ struct simdjson_ffi_stack_frame {
             Iter current;
             Iter end;
 
+            range() = default;
             range(Iter current, Iter end) : current(current), end(end) {}
         };
 
         range<simdjson::ondemand::array_iterator>  array;
         range<simdjson::ondemand::object_iterator> object;
 
+        it(): array() {}
         it(simdjson::ondemand::array &v): array(v.begin(), v.end()) {}
         it(simdjson::ondemand::object &v): object(v.begin(), v.end()) {}
     } it;
 
-    simdjson_ffi_stack_frame(simdjson::ondemand::array &v):
-        state(simdjson_ffi_resume_state::array), it(v) {}
+    simdjson_ffi_stack_frame() = default;
+
+    simdjson_ffi_stack_frame(simdjson::ondemand::array &v,
+                             const simdjson_ffi_projection *projection):
+        state(simdjson_ffi_resume_state::array), projection(projection), it(v) {}
+
+    simdjson_ffi_stack_frame(simdjson::ondemand::object &v,
+                             const simdjson_ffi_projection *projection):
+        state(simdjson_ffi_resume_state::object), projection(projection), it(v) {}
+};
+
+
+// frames are copied into place and never destroyed
+static_assert(std::is_trivially_copyable<simdjson_ffi_stack_frame>::value,
+              "simdjson_ffi_stack_frame should be trivially copyable");
+
+
+// The containers being decoded, innermost last. A fixed array of
+// `max_depth` frames allocated once, so resuming never allocates and
+// a document nested any deeper is rejected with DEPTH_ERROR.
+struct simdjson_ffi_frames {
+    std::unique_ptr<simdjson_ffi_stack_frame[]>  data;
+    size_t                                n = 0;
+    size_t                                max_depth = SIMDJSON_FFI_MAX_DEPTH;
+    // deepest nesting ever decoded, by these frames or the capi engine
+    size_t                                peak = 0;
+
+    void reserve() {
+        if (simdjson_unlikely(!data)) {
+            data.reset(new simdjson_ffi_stack_frame[max_depth]);
+        }
+    }
+
+    template<typename T>
+    void push(T &container, const simdjson_ffi_projection *projection) {
+        SIMDJSON_DEVELOPMENT_ASSERT(data);
+
+        if (simdjson_unlikely(n == max_depth)) {
+            throw simdjson::simdjson_error(simdjson::DEPTH_ERROR);
+        }
+
+        data[n++] = simdjson_ffi_stack_frame(container, projection);
 
-    simdjson_ffi_stack_frame(simdjson::ondemand::object &v):
-        state(simdjson_ffi_resume_state::object), it(v) {}
+        if (simdjson_unlikely(n > peak)) {
+            peak = n;
+        }
+    }
+
+    simdjson_ffi_stack_frame &top() {
+        SIMDJSON_DEVELOPMENT_ASSERT(n > 0);
+
+        return data[n - 1];
+    }
+
+    void pop() {
+        SIMDJSON_DEVELOPMENT_ASSERT(n > 0);
+
+        n--;
+    }
+
+    bool empty() const {
+        return n == 0;
+    }
+
+    void clear() {
+        n = 0;
+    }
+};
+
+
+// A growable byte buffer which, unlike `std::string` or `std::vector<char>`,
+// never zero fills the memory it hands out. Callers `reserve()` the worst case
+// they might write, write through the returned pointer, then bump `size`.
+struct simdjson_ffi_buffer {
+    std::unique_ptr<char[]>               data;
+    size_t                                size = 0;
+    size_t                                capacity = 0;
+
+    char *reserve(size_t n) {
+        if (simdjson_unlikely(capacity - size < n)) {
+            size_t new_capacity = std::max(capacity * 2, size + n);
+            std::unique_ptr<char[]> new_data(new char[new_capacity]);
+
+            if (size > 0) {
+                std::memcpy(new_data.get(), data.get(), size);
+            }
+
+            data = std::move(new_data);
+            capacity = new_capacity;
+        }
+
+        return data.get() + size;
+    }
+};
+
+
+// Interns the object keys of the document being decoded, so a repeated
+// key is sent to Lua as the id of its first occurrence instead of its
+// bytes. An open addressing hash table, `clear()` is O(1) because slots
+// of older epochs count as empty. Keys point into the parser's string
+// buffer, so it must be cleared whenever that buffer is reused.
+struct simdjson_ffi_keys {
+    static constexpr uint32_t             SLOTS = 1024;
+    // keep the load factor low, further keys are not interned
+    static constexpr uint32_t             MAX_KEYS = SLOTS / 2;
+
+    struct slot {
+        const char                       *str;
+        uint32_t                          len;
+        uint32_t                          id;
+        uint32_t                          epoch;
+    };
+
+    std::unique_ptr<slot[]>               slots;
+    uint32_t                              n = 0;
+    uint32_t                              epoch = 0;
+
+    void clear() {
+        n = 0;
+
+        if (simdjson_unlikely(++epoch == 0)) {
+            // wrapped around, stale slots could match again
+            slots.reset();
+        }
+    }
+
+    // Returns the id (counting from 1) `key` was interned under, otherwise
+    // interns it under the next id if there is room left and returns 0,
+    // `inserted` tells which one happened.
+    uint32_t intern(std::string_view key, bool &inserted) {
+        inserted = false;
+
+        if (simdjson_unlikely(!slots)) {
+            slots.reset(new slot[SLOTS]());
+            epoch = 1;
+        }
+
+        // FNV-1a, keys are short
+        uint32_t h = 2166136261u;
+        for (unsigned char c : key) {
+            h = (h ^ c) * 16777619u;
+        }
+
+        for (uint32_t i = h & (SLOTS - 1); ; i = (i + 1) & (SLOTS - 1)) {
+            slot &s = slots[i];
+
+            if (s.epoch != epoch) {
+                if (n == MAX_KEYS) {
+                    return 0;
+                }
+
+                s.str = key.data();
+                s.len = key.size();
+                s.id = ++n;
+                s.epoch = epoch;
+                inserted = true;
+
+                return 0;
+            }
+
+            if (s.len == key.size() && std::memcmp(s.str, key.data(), s.len) == 0) {
+                return s.id;
+            }
+        }
+    }
 };
 
 
 struct simdjson_ffi_state_t {
     simdjson::ondemand::parser            parser;
     simdjson::ondemand::document          document;
-    std::vector<simdjson_ffi_op_t>        ops;
+    // the current batch, `ops` points into the three of them
+    std::vector<uint8_t>                  opcodes;
+    std::vector<simdjson_ffi_payload_t>   payloads;
+    simdjson_ffi_buffer                   strings;
+    simdjson_ffi_ops_t                    ops = {};
     size_t                                ops_n;
-    std::stack<simdjson_ffi_stack_frame>  frames;
+    // number of ops per batch, see `simdjson_ffi_state_new()`
+    size_t                                batch_size = SIMDJSON_FFI_BATCH_SIZE;
+    // see `simdjson_ffi_state_set_batch_bytes()`
+    size_t                                batch_bytes = SIMDJSON_FFI_BATCH_BYTES;
+    simdjson_ffi_frames                   frames;
     simdjson::padded_string               json;
+    // appended to by `simdjson_ffi_append()`, always followed by room
+    // for `SIMDJSON_PADDING` bytes so it is parsed in place
+    simdjson_ffi_buffer                   body;
+    // only used by `simdjson_ffi_parse_tape()`
+    simdjson::dom::parser                 dom;
+    simdjson_ffi_tape_t                   tape = {};
+    // nullptr if the whole document is decoded
+    std::unique_ptr<simdjson_ffi_projection>  projection;
+    // emit INT64/UINT64 for integers a double can not hold exactly
+    bool                                  int64 = false;
+    simdjson_ffi_keys                     keys;
+
+    // see `simdjson_ffi_state_set_limits()`, unlimited is SIZE_MAX
+    simdjson_ffi_limits_t                 limits = {
+        SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX
+    };
+    // values of the current document so far
+    size_t                                values = 0;
+
+    // shrink policy, see `simdjson_ffi_state_set_shrink()`
+    size_t                                shrink_factor = 0;
+    size_t                                shrink_baseline = 0;
+    size_t                                sizes[SIMDJSON_FFI_SHRINK_WINDOW];
+    size_t                                sizes_n = 0;
+
+    // set by `simdjson_ffi_parse_many()`, the `stream*` fields below
+    // are only meaningful while it is true
+    bool                                  streaming = false;
+    // the document being decoded failed, resume after the end of its line
+    bool                                  stream_resync = false;
+    // the document being decoded is fine, resume after it
+    bool                                  stream_advance = false;
+    // the document being decoded was parsed on its own, up to the end of
+    // its line, which it must span
+    bool                                  stream_line = false;
+    const char                           *stream_buf = nullptr;
+    size_t                                stream_len = 0;
+    // offset of `stream` and of the current document within `stream_buf`
+    size_t                                stream_start = 0;
+    size_t                                stream_doc = 0;
+    simdjson::ondemand::document_stream   stream;
+    simdjson::ondemand::document_stream::iterator  stream_it;
+
+    // output of `simdjson_ffi_parse_batch()`, the batches of
+    // every document are appended one after another
+    std::vector<uint8_t>                  batch_opcodes;
+    std::vector<simdjson_ffi_payload_t>   batch_payloads;
+    simdjson_ffi_buffer                   batch_strings;
+    simdjson_ffi_ops_t                    batch_ops = {};
+
+    // see `simdjson_ffi_state_stats()`, `max_depth` is kept in `frames`
+    simdjson_ffi_stats_t                  stats = {};
 };
 
 
 typedef struct simdjson_ffi_state_t simdjson_ffi_state;
 
 
+struct simdjson_ffi_encoder_frame {
+    bool                                  object;
+    uint32_t                              n;
+
+    simdjson_ffi_encoder_frame(bool object): object(object), n(0) {}
+};
+
+
+struct simdjson_ffi_encoder_state_t {
+    std::vector<simdjson_ffi_op_t>           ops;
+    std::vector<simdjson_ffi_encoder_frame>  frames;
+    simdjson_ffi_buffer                      buf;
+    int                                      precision = 0;  // shortest round trip
+};
+
+
+typedef struct simdjson_ffi_encoder_state_t simdjson_ffi_encoder_state;
+
+
 #endif /* !SIMDJSON_FFI_H */
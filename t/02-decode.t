@@ -462,3 +462,139 @@ simdjson: error: STRING_ERROR: Problem while parsing a string
 
 
 
+=== TEST 12: large containers spanning many batches
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local items = {}
+            for i = 1, 5000 do
+                items[i] = string.format([[{"id": %d, "tags": [%d, %d]}]], i, i, -i)
+            end
+
+            local obj = parser:decode([[{"items": []] .. table.concat(items, ",") .. [[], "empty": [], "e": {}}]])
+            assert(#obj.items == 5000)
+            assert(#obj.empty == 0)
+            assert(next(obj.e) == nil)
+
+            for i = 1, 5000 do
+                local item = obj.items[i]
+                assert(item.id == i)
+                assert(#item.tags == 2 and item.tags[2] == -i)
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 13: repeated object keys
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local items = {}
+            for i = 1, 3000 do
+                -- more distinct keys than get interned
+                items[i] = string.format([[{"id": %d, "k%d": {"id": 1, "\u0069d2": 2}}]],
+                                         i, i % 700)
+            end
+
+            local json = "[" .. table.concat(items, ",") .. "]"
+
+            for _ = 1, 2 do
+                local obj = parser:decode(json)
+                assert(#obj == 3000)
+
+                for i = 1, 3000 do
+                    local item = obj[i]
+                    assert(item.id == i)
+
+                    local sub = item["k" .. i % 700]
+                    assert(sub.id == 1 and sub.id2 == 2)
+                end
+            end
+
+            -- key ids do not leak into the next document
+            local objs = parser:decode_batch({ [[{"a": 1, "b": {"a": 2}}]], [[{"b": 3, "a": 4}]] })
+            assert(objs[1].a == 1 and objs[1].b.a == 2)
+            assert(objs[2].b == 3 and objs[2].a == 4)
+
+            for i, obj in parser:decode_many('{"x": {"y": 1}}\n{"y": {"x": 2}}') do
+                assert(i == 1 and obj.x.y == 1 or obj.y.x == 2)
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 14: deep documents decode in linear time
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local flat = "[" .. string.rep("1,", 200000) .. "1]"
+            local deep = string.rep("[", 999) .. flat .. string.rep("]", 999)
+
+            local function time(json)
+                local best = math.huge
+
+                for _ = 1, 3 do
+                    local start = os.clock()
+                    assert(parser:decode(json))
+                    best = math.min(best, os.clock() - start)
+                end
+
+                return best
+            end
+
+            -- counting every level up front walked the elements
+            -- once per level, 1000 times here
+            local ratio = time(deep) / time(flat)
+            assert(ratio < 4, "deep document took " .. ratio .. " times as long")
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -289,3 +289,136 @@ GET /t
 
 
 
+
+
+
+=== TEST 9: data spanning multiple op batches
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local arr = {}
+            local expected = {}
+            for i = 1, 3000 do
+                arr[i] = { ["k" .. i] = "v" .. i }
+                expected[i] = [[{"k]] .. i .. [[":"v]] .. i .. [["}]]
+            end
+
+            local v = parser:encode(arr)
+            assert(type(v) == "string")
+            assert(v == "[" .. table.concat(expected, ",") .. "]")
+
+            local v, err = parser:encode({ a = { f = print } })
+            assert(v == nil)
+            ngx.say(err)
+
+            local v = parser:encode({ 1, 2, 3 })
+            assert(v == "[1,2,3]")
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+unsupported data type: function
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 10: string escaping
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local raw = "a\"b\\c/d\1\127\n\t\r\b\f\31é"
+            local escaped = [[a\"b\\c\/d\u0001\u007f\n\t\r\b\f\u001fé]]
+
+            assert(parser:encode(raw) == '"' .. escaped .. '"')
+            assert(parser:encode({ [raw] = raw }) ==
+                   '{"' .. escaped .. '":"' .. escaped .. '"}')
+
+            -- escapes before, across and after the vectorized blocks
+            local long = string.rep("x", 100)
+            for _, pos in ipairs({ 1, 16, 17, 32, 33, 63, 64, 65, 100 }) do
+                local s = long:sub(1, pos - 1) .. "/" .. long:sub(pos + 1)
+                local e = long:sub(1, pos - 1) .. "\\/" .. long:sub(pos + 1)
+                assert(parser:encode(s) == '"' .. e .. '"')
+            end
+
+            local buf = {}
+            local function cb(s)
+                buf[#buf + 1] = s
+            end
+
+            assert(parser.encoder:encode_helper({ [raw] = raw }, cb))
+            assert(table.concat(buf) ==
+                   '{"' .. escaped .. '":"' .. escaped .. '"}')
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 11: long strings are escaped in chunks
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            -- escapes right before, on and after the 64 KB chunk boundaries
+            local chunk = 64 * 1024
+            local parts, expected = {}, {}
+            for i = 1, 40 do
+                local n = (i % 3 == 0) and chunk - 1 or (i % 3 == 1) and chunk or chunk + 1
+                parts[i] = string.rep("x", n - 1) .. "\n"
+                expected[i] = string.rep("x", n - 1) .. "\\n"
+            end
+
+            local s = table.concat(parts)
+            local res = parser:encode(s)
+            assert(res == '"' .. table.concat(expected) .. '"')
+            assert(parser:decode(res) == s)
+
+            -- the large output buffer is released, later encodes still work
+            assert(parser:encode({ a = "\"" }) == [[{"a":"\""}]])
+            assert(parser:decode(parser:encode(s)) == s)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -22,7 +22,7 @@ run_tests();
 __DATA__
 
 
-=== TEST 1: default precision is 16
+=== TEST 1: default precision round trips
 --- http_config eval: $::HttpConfig
 --- config
     location = /t {
@@ -95,3 +95,40 @@ GET /t
 
 
 
+=== TEST 3: default is the shortest representation that round trips
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            ngx.say(parser:encode({ 0.1 + 0.2, 40.7128, -74.006, 1e300, -0.0, 9007199254740993 }))
+
+            parser:encode_number_precision(16)
+
+            ngx.say(parser:encode({ 0.1 + 0.2, 40.7128, -74.006, 1e300, -0.0, 9007199254740993 }))
+
+            local buf = {}
+            assert(parser.encoder:encode_helper({ 0.1 + 0.2, 42 }, function(s)
+                buf[#buf + 1] = s
+            end))
+
+            ngx.say(table.concat(buf))
+        }
+    }
+--- request
+GET /t
+--- response_body
+[0.30000000000000004,40.7128,-74.006,1e+300,-0,9007199254740992]
+[0.3,40.7128,-74.006,1e+300,-0,9007199254740992]
+[0.3,42]
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
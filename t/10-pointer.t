@@ -0,0 +1,114 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: get values by JSON pointer
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local json = [[
+                {
+                    "model": "gpt",
+                    "metadata": { "tenant": "t1", "tags": [1, 2, { "a/b": null }] },
+                    "list": [10, 20, 30]
+                }
+            ]]
+
+            assert(parser:get(json, "/model") == "gpt")
+            assert(parser:get(json, "/metadata/tenant") == "t1")
+            assert(parser:get(json, "/list/1") == 20)
+            assert(parser:get(json, "/metadata/tags/2/a~1b") == ngx.null)
+
+            local v = parser:get(json, "/metadata")
+            assert(type(v) == "table")
+            assert(v.tenant == "t1")
+            assert(#v.tags == 3)
+
+            local v = parser:get(json, "")
+            assert(v.model == "gpt")
+
+            local v, err = parser:get(json, "/nope")
+            assert(v == nil and err == nil)
+
+            local v, err = parser:get(json, "/list/3")
+            assert(v == nil and err == nil)
+
+            local v, err = parser:get(json, "model")
+            assert(v == nil)
+            ngx.say(err)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: INVALID_JSON_POINTER: Invalid JSON pointer syntax.
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: content after the target is not looked at
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local json = [[ { "a": [1, 2, 3], "b": ]] ..
+                         "[" .. string.rep("1,", 3000) .. "1]" ..
+                         [[, "c": tru } ]]
+
+            local v = parser:get(json, "/a")
+            assert(#v == 3)
+
+            local v = parser:get(json, "/b")
+            assert(#v == 3001)
+
+            local v, err = parser:decode(json)
+            assert(v == nil and err)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,153 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: decode with projection
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local json = [[
+                {
+                    "model": "gpt",
+                    "big": [1, 2, 3, { "x": 1 }],
+                    "metadata": { "tenant": "t1", "x": [1, 2], "s": "str" },
+                    "items": [{ "name": "a", "v": 1 }, 5, { "v": 2 }],
+                    "a/b": { "~": 1, "z": 2 }
+                }
+            ]]
+
+            local obj = parser:decode(json, { projection = { "model", "/metadata/tenant" } })
+            assert(obj.model == "gpt")
+            assert(obj.big == nil)
+            assert(obj.metadata.tenant == "t1")
+            assert(obj.metadata.x == nil)
+            assert(obj.items == nil)
+
+            local obj = parser:decode(json, { projection = { "/items/name", "/a~1b/~0", "/model/x" } })
+            assert(obj.model == nil)
+            assert(#obj.items == 2)
+            assert(obj.items[1].name == "a")
+            assert(obj.items[1].v == nil)
+            assert(next(obj.items[2]) == nil)
+            assert(obj["a/b"]["~"] == 1)
+            assert(obj["a/b"].z == nil)
+
+            local obj = parser:decode(json, { projection = { "/nothing" } })
+            assert(next(obj) == nil)
+
+            local obj = parser:decode(json, { projection = { "model", "" } })
+            assert(obj.big[4].x == 1)
+
+            -- no projection
+            local obj = parser:decode(json)
+            assert(obj.model == "gpt")
+            assert(#obj.big == 4)
+
+            -- scalars in arrays are dropped like scalars in objects
+            local obj = parser:decode('{"a":[10,{"b":2,"c":3},[20,{"b":4}]],"z":1}',
+                                      { projection = { "/a/b" } })
+            assert(obj.z == nil)
+            assert(#obj.a == 2)
+            assert(obj.a[1].b == 2 and obj.a[1].c == nil)
+            assert(#obj.a[2] == 1 and obj.a[2][1].b == 4)
+
+            local obj = parser:decode('[1, { "a": 1, "b": 2 }, "s"]', { projection = { "a" } })
+            assert(#obj == 1 and obj[1].a == 1 and obj[1].b == nil)
+
+            local obj, err = parser:decode(json, { projection = { "/a~2" } })
+            assert(obj == nil)
+            ngx.say(err)
+
+            local obj, err = parser:decode(json, { projection = { "/items/0/name" } })
+            assert(obj == nil)
+            ngx.say(err)
+
+            -- only JSON Pointers are parsed
+            local obj = parser:decode([[ {"0":1,"1":2} ]], { projection = { "0" } })
+            assert(obj["0"] == 1 and obj["1"] == nil)
+
+            -- the projection is not left behind after an error
+            local obj = parser:decode(json)
+            assert(#obj.items == 3)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: invalid projection path
+simdjson: error: array indices are not supported in projection paths
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: projection is reused across batches
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new(true)
+            assert(parser)
+
+            local items = {}
+            for i = 1, 3000 do
+                items[i] = string.format([[{ "k": %d, "skip": [1, 2, 3] }]], i)
+            end
+
+            local json = "[" .. table.concat(items, ",") .. "]"
+            local projection = { "k" }
+
+            for _ = 1, 2 do
+                local obj = parser:decode(json, { projection = projection })
+                assert(#obj == 3000)
+
+                for i = 1, 3000 do
+                    assert(obj[i].k == i)
+                    assert(obj[i].skip == nil)
+                end
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
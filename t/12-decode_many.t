@@ -0,0 +1,219 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: decode NDJSON, bad records are skipped
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local body = table.concat({
+                [[{"a": 1}]],
+                [[{"a": tru}]],
+                [[{"a": "x}]],
+                [[]],
+                [["str"]],
+                [[[1, {"b": null}] ]],
+                [[{"a": [1, 2}]],
+                [[{"a": 3}]],
+                '{"a": [4]',
+            }, "\n")
+
+            for i, obj, err in parser:decode_many(body) do
+                if err then
+                    ngx.say(i, ": ", err)
+
+                elseif type(obj) == "table" then
+                    ngx.say(i, ": ", obj.a or #obj)
+
+                else
+                    ngx.say(i, ": ", obj)
+                end
+            end
+
+            -- the parser is still usable afterwards
+            assert(parser:decode([[{"a": 1}]]).a == 1)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+1: 1
+2: simdjson: error: INCORRECT_TYPE: The JSON element does not have the requested type.
+3: simdjson: error: UNCLOSED_STRING: A string is opened, but never closed.
+4: str
+5: 2
+6: simdjson: error: TAPE_ERROR: The JSON document has an improper structure: missing or superfluous commas, braces, missing keys, etc.
+7: 3
+8: simdjson: error: INCOMPLETE_ARRAY_OR_OBJECT: JSON document ended early in the middle of an object or array.
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: decode_many with projection and multiple batches
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new(true)
+            assert(parser)
+
+            local lines = {}
+            for i = 1, 1000 do
+                lines[i] = string.format([[{"id": %d, "tags": [%s]}]], i,
+                                         string.rep("1,", 2999) .. "1")
+            end
+
+            local iter = assert(parser:decode_many(table.concat(lines, "\n"),
+                                                   { projection = { "id" } }))
+
+            local count = 0
+            for i, obj, err in iter do
+                assert(not err)
+                assert(obj.id == i)
+                assert(obj.tags == nil)
+                count = i
+            end
+
+            assert(count == 1000)
+
+            local iter = assert(parser:decode_many(table.concat(lines, "\n")))
+
+            local i, obj = iter()
+            assert(i == 1 and #obj.tags == 3000)
+
+            parser:decode("[]")
+
+            local ok, err = pcall(iter)
+            assert(not ok)
+            ngx.say(err)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+parser was used by another decode during iteration
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: decode_many with documents larger than a batch
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local function decode(json)
+                local res = {}
+                for i, obj, err in assert(parser:decode_many(json)) do
+                    res[i] = obj and (obj.b or #obj.a) or err
+                end
+                return table.concat(res, " ")
+            end
+
+            -- twice the 1 MB batch size of the stream
+            local big = string.rep("x", 2 * 1024 * 1024)
+
+            ngx.say(decode('{"b":1}\n{"a":"' .. big .. '"}\n{"b":2}'))
+            ngx.say(decode('{"b":1} {"a":"' .. big .. '"} {"b":2} {"a":"' .. big .. '"} {"b":3}'))
+            ngx.say(decode('{"b":1}\n{\n  "a": "' .. big .. '"\n}\n{"b":2}'))
+            ngx.say(decode('{"b":1}\n{"a":"' .. big .. '"'))
+        }
+    }
+--- request
+GET /t
+--- response_body
+1 2097152 2
+1 2097152 2 2097152 3
+1 2097152 2
+1 simdjson: error: INCOMPLETE_ARRAY_OR_OBJECT: JSON document ended early in the middle of an object or array.
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 4: decode_many after a truncated stream
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local function decode(json)
+                local res = {}
+                for i, obj, err in assert(parser:decode_many(json)) do
+                    res[i] = obj and obj.a or err
+                end
+                return "[" .. table.concat(res, ", ") .. "]"
+            end
+
+            ngx.say(decode('{"a":1}\n{"a":2'))
+            ngx.say(decode(''))
+            ngx.say(decode('\n  \n'))
+            ngx.say(decode('{"a":3}'))
+
+            -- documents sharing a line with others can not be told apart
+            -- when the batch holds a bad string
+            ngx.say(decode('{"a":4} {"a":5}\n{"a":"\1"}\n{"a":6}'))
+        }
+    }
+--- request
+GET /t
+--- response_body
+[1, simdjson: error: INCOMPLETE_ARRAY_OR_OBJECT: JSON document ended early in the middle of an object or array.]
+[]
+[]
+[3]
+[simdjson: error: TRAILING_CONTENT: Unexpected trailing content in the JSON input., simdjson: error: UNESCAPED_CHARS: Within strings, some characters must be escaped, we found unescaped characters, 6]
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,123 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: decode a batch of JSON strings
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local objs, errs = parser:decode_batch({
+                [[{"sub": "user", "roles": ["a", "b"]}]],
+                [[null]],
+                [[1 2]],
+                [["str\"q"]],
+                [[[1, 2]],
+                [[]],
+                [[{"z": "last"}]],
+            })
+
+            assert(objs[1].sub == "user")
+            assert(objs[1].roles[2] == "b")
+            assert(objs[2] == ngx.null)
+            assert(objs[4] == "str\"q")
+            assert(objs[7].z == "last")
+
+            for i = 1, 7 do
+                if errs[i] then
+                    assert(objs[i] == nil)
+                    ngx.say(i, ": ", errs[i])
+                end
+            end
+
+            local objs, errs = parser:decode_batch({ "true", "[]" })
+            assert(objs[1] == true)
+            assert(#objs[2] == 0)
+            assert(errs == nil)
+
+            local objs, errs = parser:decode_batch({})
+            assert(#objs == 0 and errs == nil)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+3: simdjson: error: TRAILING_CONTENT: Unexpected trailing content in the JSON input.
+5: simdjson: error: INCOMPLETE_ARRAY_OR_OBJECT: JSON document ended early in the middle of an object or array.
+6: simdjson: error: EMPTY: no JSON found
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: large documents and projection in a batch
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new(true)
+            assert(parser)
+
+            local strs = {}
+            for i = 1, 3000 do
+                strs[i] = [["s]] .. i .. [["]]
+            end
+
+            local big = [[{"list": []] .. table.concat(strs, ",") .. [[], "n": 1}]]
+            local jsons = { big, [[{"n": 2, "list": []}]], big }
+
+            local objs, errs = parser:decode_batch(jsons)
+            assert(errs == nil)
+            assert(#objs[1].list == 3000)
+            assert(objs[1].list[3000] == "s3000")
+            assert(objs[2].n == 2)
+            assert(objs[3].list[1] == "s1")
+
+            local objs = parser:decode_batch(jsons, { projection = { "n" } })
+            assert(objs[1].n == 1 and objs[1].list == nil)
+            assert(objs[2].n == 2 and objs[2].list == nil)
+            assert(objs[3].n == 1 and objs[3].list == nil)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
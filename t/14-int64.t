@@ -0,0 +1,98 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: integers beyond 2^53 are rounded by default
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local obj = parser:decode([[ [1, -0, 9007199254740993, 18446744073709551615, 1.5] ]])
+            assert(obj[1] == 1)
+            assert(1 / obj[2] == -math.huge)
+            assert(obj[3] == 9007199254740992)
+            assert(type(obj[4]) == "number")
+            assert(obj[5] == 1.5)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: int64 option
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ int64 = true })
+            assert(parser)
+
+            local json = [[{"small":9007199254740992,"id":9007199254740993,]] ..
+                         [["neg":-9223372036854775808,"big":18446744073709551615,"f":1.5}]]
+
+            local obj = parser:decode(json)
+            assert(type(obj.small) == "number")
+            assert(obj.f == 1.5)
+            ngx.say(tostring(obj.id))
+            ngx.say(tostring(obj.neg))
+            ngx.say(tostring(obj.big))
+
+            ngx.say(parser:encode({ obj.id, obj.neg, obj.big, 1ULL }))
+            local buf = {}
+            assert(parser.encoder:encode_helper({ obj.id, obj.big }, function(s, t)
+                t[#t + 1] = s
+            end, buf))
+            ngx.say(table.concat(buf))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+9007199254740993LL
+-9223372036854775808LL
+18446744073709551615ULL
+[9007199254740993,-9223372036854775808,18446744073709551615,1]
+[9007199254740993,18446744073709551615]
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
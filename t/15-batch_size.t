@@ -0,0 +1,129 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: small batches
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ batch_size = 2 })
+            assert(parser)
+
+            local obj = parser:decode([[ {"a":[1,[2,[3] ],{"b":{"c":"d"}}],"e":{},"f":[],"g":"h"} ]])
+            assert(obj.a[1] == 1)
+            assert(obj.a[2][1] == 2)
+            assert(obj.a[2][2][1] == 3)
+            assert(obj.a[3].b.c == "d")
+            assert(next(obj.e) == nil)
+            assert(#obj.f == 0)
+            assert(obj.g == "h")
+
+            local t = {}
+            for i = 1, 1000 do
+                t[i] = i
+            end
+
+            local arr = parser:decode("[" .. table.concat(t, ",") .. "]")
+            assert(#arr == 1000)
+            assert(arr[1000] == 1000)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: small batches yield more often
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local _sleep = _G.ngx.sleep
+            ngx.ctx.yields = 0
+            _G.ngx.sleep = function()
+                ngx.ctx.yields = ngx.ctx.yields + 1
+            end
+
+            local t = {}
+            for i = 1, 100 do
+                t[i] = i
+            end
+
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ yieldable = true, batch_size = 10 })
+            assert(parser)
+
+            local arr = parser:decode("[" .. table.concat(t, ",") .. "]")
+            assert(#arr == 100)
+
+            _G.ngx.sleep = _sleep
+
+            ngx.say(ngx.ctx.yields >= 10)
+        }
+    }
+--- request
+GET /t
+--- response_body
+true
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: invalid batch size
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            for _, size in ipairs({ 0, 1, 1.5, 1048577, "16" }) do
+                local ok = pcall(simdjson.new, { batch_size = size })
+                assert(not ok)
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
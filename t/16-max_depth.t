@@ -0,0 +1,120 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: default max depth
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local obj = parser:decode(string.rep("[", 1024) .. string.rep("]", 1024))
+            for _ = 1, 1023 do
+                obj = obj[1]
+            end
+
+            assert(type(obj) == "table" and next(obj) == nil)
+
+            local obj, err = parser:decode(string.rep("[", 1025) .. string.rep("]", 1025))
+            assert(obj == nil)
+            ngx.say(err)
+
+            -- the parser is still usable afterwards
+            ngx.say(parser:decode([[ {"a":[{"b":1}]} ]]).a[1].b)
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: DEPTH_ERROR: The JSON document was too deep (too many nested objects and arrays)
+1
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: configured max depth
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ max_depth = 2, batch_size = 2 })
+            assert(parser)
+
+            assert(parser:decode([[ {"a":[1,2,3],"b":{"c":true}} ]]).b.c == true)
+
+            for _, json in ipairs({ "[[[1]]]", [[ {"a":{"b":{}}} ]], [[ [{"a":[]}] ]] }) do
+                local obj, err = parser:decode(json)
+                assert(obj == nil)
+                assert(string.find(err, "DEPTH_ERROR", 1, true))
+            end
+
+            local objs, errs = parser:decode_batch({ "[[1]]", "[[[1]]]" })
+            assert(objs[1][1][1] == 1)
+            assert(string.find(errs[2], "DEPTH_ERROR", 1, true))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: invalid max depth
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            for _, depth in ipairs({ 0, 1.5, 65537, "16" }) do
+                local ok = pcall(simdjson.new, { max_depth = depth })
+                assert(not ok)
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
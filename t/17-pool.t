@@ -0,0 +1,151 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: parsers are reused last in first out
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local pool = simdjson.new_pool({ size = 2, yieldable = true })
+
+            local a = pool:checkout()
+            local b = pool:checkout()
+            local c = pool:checkout()
+            assert(a ~= b and b ~= c and a ~= c)
+            assert(a.decoder.yieldable)
+
+            pool:checkin(a)
+            pool:checkin(b)
+            -- over the size of the pool, destroyed
+            pool:checkin(c)
+            assert(c.decoder.state == nil)
+            assert(pool:count() == 2)
+
+            assert(pool:checkout() == b)
+            assert(pool:checkout() == a)
+            assert(pool:count() == 0)
+
+            pool:checkin(a)
+            assert(not pcall(pool.checkin, pool, a))
+
+            pool:flush()
+            assert(pool:count() == 0)
+            assert(a.decoder.state == nil)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: concurrent yieldable decodes
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local pool = simdjson.new_pool({ yieldable = true })
+
+            local t = {}
+            for i = 1, 5000 do
+                t[i] = i
+            end
+
+            local json = "[" .. table.concat(t, ",") .. "]"
+
+            local function decode()
+                local parser = pool:checkout()
+                local obj = parser:decode(json)
+                pool:checkin(parser)
+
+                return #obj
+            end
+
+            local threads = {}
+            for i = 1, 4 do
+                threads[i] = ngx.thread.spawn(decode)
+            end
+
+            for i = 1, 4 do
+                local ok, n = ngx.thread.wait(threads[i])
+                assert(ok and n == 5000)
+            end
+
+            ngx.say(pool:count())
+        }
+    }
+--- request
+GET /t
+--- response_body
+4
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: parsers in use or destroyed are not pooled
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local pool = simdjson.new_pool()
+
+            local parser = pool:checkout()
+            parser:destroy()
+            pool:checkin(parser)
+            assert(pool:count() == 0)
+
+            parser = pool:checkout()
+            parser.decoder.decoding = true
+            pool:checkin(parser)
+            assert(pool:count() == 0)
+
+            assert(not pcall(simdjson.new_pool, { size = -1 }))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,138 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: memory report
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local m = parser:memory()
+            assert(m.capacity == 0 and m.string_buf == 0 and m.copy == 0)
+
+            local json = [[{"a":"]] .. string.rep("x", 100000) .. [["}]]
+            assert(parser:decode(json))
+
+            m = parser:memory()
+            assert(m.capacity >= #json)
+            assert(m.string_buf > m.capacity)
+            -- the longest string of a batch
+            assert(m.ops > 100000)
+            -- released once the decode is done
+            assert(m.copy == 0)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: shrink after an oversized document
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ shrink_factor = 4, shrink_baseline = 4096 })
+            assert(parser)
+
+            local big = [[{"a":"]] .. string.rep("x", 1000000) .. [["}]]
+            assert(parser:decode(big))
+            assert(parser:memory().capacity >= #big)
+
+            -- a full window of 16 documents is needed
+            for i = 1, 14 do
+                assert(parser:decode([[{"a":[1,2,3]}]]))
+                assert(parser:memory().capacity >= #big)
+            end
+
+            assert(parser:decode([[{"a":[1,2,3]}]]))
+
+            local m = parser:memory()
+            assert(m.capacity <= 4096)
+            assert(m.ops < 1000000)
+
+            -- grows back on demand
+            assert(parser:decode(big).a == string.rep("x", 1000000))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: no shrink by default
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            assert(parser)
+
+            local big = "[" .. string.rep("1,", 500000) .. "1]"
+            assert(parser:decode(big))
+
+            for i = 1, 32 do
+                assert(parser:decode("[1]"))
+            end
+
+            assert(parser:memory().capacity >= #big)
+
+            assert(not pcall(simdjson.new, { shrink_factor = -1 }))
+            assert(not pcall(simdjson.new, { shrink_factor = 2, shrink_baseline = 0.5 }))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,204 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: limits are enforced
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({
+                max_document_size = 64,
+                max_elements = 3,
+                max_values = 8,
+                max_string_length = 4,
+            })
+            assert(parser)
+
+            local obj = parser:decode([[ {"abcd":[1,2,3],"b":"wxyz"} ]])
+            assert(obj.abcd[3] == 3 and obj.b == "wxyz")
+
+            for _, json in ipairs({
+                "[" .. string.rep(" ", 64) .. "]",
+                "[1,2,3,4]",
+                [[ {"a":1,"b":2,"c":3,"d":4} ]],
+                "[[1],[2],[3,[4,[5]]]]",
+                [[ ["abcde"] ]],
+                [[ {"abcde":1} ]],
+            }) do
+                local obj, err = parser:decode(json)
+                assert(obj == nil)
+                ngx.say(err)
+            end
+
+            -- the parser is still usable afterwards
+            assert(parser:decode("[1,2,3]")[3] == 3)
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: LIMIT_EXCEEDED: The document is larger than max_document_size.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: The document has more values than max_values.
+simdjson: error: LIMIT_EXCEEDED: A string is longer than max_string_length.
+simdjson: error: LIMIT_EXCEEDED: A string is longer than max_string_length.
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: limits apply to every document
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ max_values = 3, batch_size = 2 })
+            assert(parser)
+
+            local objs, errs = parser:decode_batch({ "[1,2]", "[1,2,3]", "[3]" })
+            assert(objs[1][2] == 2 and objs[3][1] == 3)
+            assert(string.find(errs[2], "max_values", 1, true))
+
+            local res = {}
+            for i, obj, err in parser:decode_many("[1,2]\n[1,2,3]\n[4]") do
+                res[i] = obj and obj[1] or err
+            end
+
+            assert(res[1] == 1 and res[3] == 4)
+            assert(string.find(res[2], "max_values", 1, true))
+
+            -- only what is decoded counts
+            assert(parser:decode([[ {"a":[1,2,3],"b":1} ]], { projection = { "b" } }).b == 1)
+            assert(parser:get("[1,[2,3,4]]", "/1/2") == 4)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: invalid limits
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            for _, name in ipairs({ "max_document_size", "max_elements", "max_values", "max_string_length" }) do
+                for _, limit in ipairs({ 0, -1, 1.5, "16" }) do
+                    local ok = pcall(simdjson.new, { [name] = limit })
+                    assert(not ok)
+                end
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 4: max_elements holds for deep and projected containers
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local function nest(json, depth)
+                return string.rep("[", depth) .. json .. string.rep("]", depth)
+            end
+
+            for _, opts in ipairs({
+                { max_elements = 3 },
+                { max_elements = 3, yieldable = true },
+                { max_elements = 3, engine = "dom" },
+            }) do
+                local parser = simdjson.new(opts)
+                assert(parser)
+
+                -- only the outermost containers are counted up front
+                local arr = parser:decode(nest("[1,2,3]", 10))
+                for _ = 1, 10 do
+                    arr = arr[1]
+                end
+                assert(#arr == 3)
+
+                local _, err = parser:decode(nest("[1,2,3,4]", 10))
+                ngx.say(err)
+
+                assert(parser:decode(nest([[{"a":1,"b":2,"c":3}]], 10)))
+                _, err = parser:decode(nest([[{"a":1,"b":2,"c":3,"d":4}]], 10))
+                ngx.say(err)
+            end
+
+            local parser = simdjson.new({ max_elements = 3 })
+
+            -- projected objects are not counted up front either
+            local _, err = parser:decode([[ {"a":1,"b":2,"c":3,"d":4} ]], { projection = { "a" } })
+            ngx.say(err)
+
+            for _, obj, err in parser:decode_many(nest("[1,2,3,4]", 10) .. "\n" .. nest("[5]", 10)) do
+                ngx.say(err or obj[1][1][1][1][1][1][1][1][1][1][1])
+            end
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+5
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,199 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: dom engine decodes like ondemand
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local dom = simdjson.new({ engine = "dom" })
+            local ondemand = simdjson.new()
+
+            for _, json in ipairs({
+                [[ {"a":[1,2,{"b":"c\né"}],"e":1.5,"f":9007199254740993,"g":-5} ]],
+                [[ {"h":18446744073709551615,"i":null,"j":true,"k":false,"l":[],"m":{}} ]],
+                [[ [-9223372036854775808,4294967296,-4294967297,4294967295,1e300] ]],
+                [[ "str" ]],
+                "42",
+                "null",
+                -- left to ondemand
+                [[ [123456789012345678901234567890,-0,-0.0,"-0",-0.5,-1e-0] ]],
+                "-0",
+                "-123456789012345678901234567890",
+            }) do
+                local a = assert(dom:decode(json))
+                local b = assert(ondemand:decode(json))
+                assert(ondemand:encode(a) == ondemand:encode(b))
+            end
+
+            local arr = dom:decode([[ [123456789012345678901234567890,-0] ]])
+            assert(arr[1] == 1.2345678901234568e29 and 1 / arr[2] == -math.huge)
+
+            for _, json in ipairs({ "[1 2]", [[ {"a":1} x ]], "[", "" }) do
+                local obj, err = dom:decode(json)
+                assert(obj == nil and string.find(err, "simdjson: error: ", 1, true))
+            end
+
+            local big = dom:decode("[" .. string.rep("1,", 100000) .. "1]")
+            assert(#big == 100001)
+
+            ngx.say(dom:memory().dom_capacity > 0)
+        }
+    }
+--- request
+GET /t
+--- response_body
+true
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: dom engine with int64, depth and limits
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ engine = "dom", int64 = true })
+            local arr = parser:decode("[9007199254740993,-9223372036854775808,18446744073709551615,5]")
+            ngx.say(tostring(arr[1]), " ", tostring(arr[2]), " ", tostring(arr[3]), " ", arr[4])
+
+            parser = simdjson.new({ engine = "dom", max_depth = 2 })
+            assert(parser:decode("[[1]]")[1][1] == 1)
+            ngx.say(select(2, parser:decode("[[[1]]]")))
+
+            parser = simdjson.new({ engine = "dom", max_elements = 3, max_values = 8,
+                                    max_string_length = 4 })
+            assert(parser:decode([[ {"abcd":[1,2,3],"b":"wxyz"} ]]).b == "wxyz")
+
+            for _, json in ipairs({ "[1,2,3,4]", "[[1],[2],[3,[4,[5]]]]", [[ {"abcde":1} ]] }) do
+                ngx.say(select(2, parser:decode(json)))
+            end
+        }
+    }
+--- request
+GET /t
+--- response_body
+9007199254740993LL -9223372036854775808LL 18446744073709551615ULL 5
+simdjson: error: DEPTH_ERROR: The JSON document was too deep (too many nested objects and arrays)
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: The document has more values than max_values.
+simdjson: error: LIMIT_EXCEEDED: A string is longer than max_string_length.
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: engine selection
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            assert(not pcall(simdjson.new, { engine = "dom", yieldable = true }))
+            assert(not pcall(simdjson.new, { engine = "tape" }))
+
+            local parser = simdjson.new({ engine = "auto" })
+
+            local small = [[ {"a":1,"b":[2]} ]]
+            local large = "[" .. string.rep("1,", 200000) .. "1]"
+
+            assert(parser:decode(small).b[1] == 2)
+            local dom_capacity = parser:memory().dom_capacity
+            assert(dom_capacity >= #small)
+
+            -- too large for the tape, decoded with capi or ondemand
+            assert(#parser:decode(large) == 200001)
+            assert(parser:memory().dom_capacity == dom_capacity)
+            assert(parser:memory().capacity >= #large)
+
+            -- projections always use ondemand
+            assert(parser:decode([[ {"a":1,"b":2,"c":3} ]], { projection = { "b" } }).a == nil)
+
+            -- yieldable parsers always use ondemand
+            parser = simdjson.new({ engine = "auto", yieldable = true })
+            assert(parser:decode(small).a == 1)
+            assert(parser:memory().dom_capacity == 0)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 4: temporary dom parsers are not collected while building
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local items = {}
+            for i = 1, 5000 do
+                items[i] = string.format([[{"id":%d,"name":"item %d"}]], i, i)
+            end
+            local json = "[" .. table.concat(items, ",") .. "]"
+
+            -- collect as often as possible, the parser is only referenced
+            -- by the decode running on it
+            collectgarbage("setpause", 0)
+
+            for _ = 1, 50 do
+                local arr = simdjson.new({ engine = "dom" }):decode(json)
+
+                for i = 1, 5000 do
+                    assert(arr[i].id == i and arr[i].name == "item " .. i)
+                end
+            end
+
+            collectgarbage("setpause", 200)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
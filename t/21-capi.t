@@ -0,0 +1,202 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: capi engine decodes like ondemand
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local capi = simdjson.new({ engine = "capi" })
+            local ondemand = simdjson.new()
+
+            for _, json in ipairs({
+                [[ {"a":[1,2,{"b":"c\né"}],"e":1.5,"f":9007199254740993,"g":-5,"n":-0} ]],
+                [[ {"h":18446744073709551615,"i":null,"j":true,"k":false,"l":[],"m":{}} ]],
+                [[ [-9223372036854775808,4294967296,-4294967297,4294967295,1e300] ]],
+                [[ "str" ]],
+                "42",
+                "null",
+                "false",
+            }) do
+                local a, err = capi:decode(json)
+                assert(err == nil)
+                local b = ondemand:decode(json)
+                assert(ondemand:encode(a) == ondemand:encode(b))
+            end
+
+            for _, json in ipairs({ "[1 2]", [[ {"a":1} x ]], "[", "", [[ {"a"} ]] }) do
+                local obj, err = capi:decode(json)
+                local obj2, err2 = ondemand:decode(json)
+                assert(obj == nil and err == err2)
+            end
+
+            local big = capi:decode("[" .. string.rep("1,", 100000) .. "1]")
+            ngx.say(#big)
+        }
+    }
+--- request
+GET /t
+--- response_body
+100001
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: capi engine with int64, depth and limits
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            -- falls back to ondemand for the cdata
+            local parser = simdjson.new({ engine = "capi", int64 = true })
+            local arr = parser:decode("[9007199254740993,-9223372036854775808,18446744073709551615,5]")
+            ngx.say(tostring(arr[1]), " ", tostring(arr[2]), " ", tostring(arr[3]), " ", arr[4])
+            ngx.say(parser:decode("[9007199254740992]")[1])
+
+            parser = simdjson.new({ engine = "capi", max_depth = 2 })
+            assert(parser:decode("[[1]]")[1][1] == 1)
+            assert(parser:decode([[ {"a":{"b":1}} ]]).a.b == 1)
+            ngx.say(select(2, parser:decode("[[[1]]]")))
+
+            parser = simdjson.new({ engine = "capi", max_elements = 3, max_values = 8,
+                                    max_string_length = 4 })
+            assert(parser:decode([[ {"abcd":[1,2,3],"b":"wxyz"} ]]).b == "wxyz")
+
+            for _, json in ipairs({ "[1,2,3,4]", "[[1],[2],[3,[4,[5]]]]", [[ {"abcde":1} ]] }) do
+                ngx.say(select(2, parser:decode(json)))
+            end
+        }
+    }
+--- request
+GET /t
+--- response_body
+9007199254740993LL -9223372036854775808LL 18446744073709551615ULL 5
+9.007199254741e+15
+simdjson: error: DEPTH_ERROR: The JSON document was too deep (too many nested objects and arrays)
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: The document has more values than max_values.
+simdjson: error: LIMIT_EXCEEDED: A string is longer than max_string_length.
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: capi engine selection
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            assert(not pcall(simdjson.new, { engine = "capi", yieldable = true }))
+
+            local parser = simdjson.new({ engine = "capi" })
+
+            -- projections always use ondemand
+            local obj = parser:decode([[ {"a":1,"b":2,"c":3} ]], { projection = { "b" } })
+            assert(obj.a == nil and obj.b == 2)
+
+            -- no DOM parser involved
+            assert(parser:decode([[ {"a":[1]} ]]).a[1] == 1)
+            assert(parser:memory().dom_capacity == 0)
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 4: capi engine on deep documents, and the state it is passed
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ engine = "capi", max_elements = 3 })
+
+            local function nest(json, depth)
+                return string.rep("[", depth) .. json .. string.rep("]", depth)
+            end
+
+            -- only the outermost containers are counted up front
+            assert(parser:decode(nest("[1,2,3]", 10)))
+            ngx.say(select(2, parser:decode(nest("[1,2,3,4]", 10))))
+            ngx.say(select(2, parser:decode(nest([[{"a":1,"b":2,"c":3,"d":4}]], 10))))
+
+            parser = simdjson.new({ engine = "capi" })
+
+            local flat = "[" .. string.rep("1,", 200000) .. "1]"
+            local deep = nest(flat, 999)
+
+            local function time(json)
+                local best = math.huge
+
+                for _ = 1, 3 do
+                    local start = os.clock()
+                    assert(parser:decode(json))
+                    best = math.min(best, os.clock() - start)
+                end
+
+                return best
+            end
+
+            local ratio = time(deep) / time(flat)
+            assert(ratio < 4, "deep document took " .. ratio .. " times as long")
+
+            -- a number could be any address
+            local capi = require("resty.simdjson.capi")
+            local ok, err = pcall(capi.decode, 12345, "[]", ngx.null)
+            assert(not ok and string.find(err, "cdata expected", 1, true))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
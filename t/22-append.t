@@ -0,0 +1,153 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: append and finish decode like decode
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            local json = [[ {"a":[1,2,{"b":"c\né"}],"e":1.5,"f":null,"g":true} ]]
+
+            for size = 1, #json do
+                for i = 1, #json, size do
+                    assert(parser:append(string.sub(json, i, i + size - 1)))
+                end
+
+                local obj = assert(parser:finish())
+                assert(parser:encode(obj) == parser:encode(parser:decode(json)))
+            end
+
+            -- every finish starts a new body
+            assert(parser:append("[1,"))
+            assert(parser:append("2]"))
+            ngx.say(#parser:finish())
+
+            ngx.say(select(2, parser:finish()))
+
+            assert(parser:append("[1] x"))
+            ngx.say(select(2, parser:finish()))
+
+            assert(parser:append("[1,"))
+            parser:discard()
+            assert(parser:append("42"))
+            ngx.say(parser:finish())
+        }
+    }
+--- request
+GET /t
+--- response_body
+2
+simdjson: error: EMPTY: no JSON found
+simdjson: error: INCOMPLETE_ARRAY_OR_OBJECT: JSON document ended early in the middle of an object or array.
+42
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: yieldable append, limits and memory
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ yieldable = true, batch_size = 2,
+                                          max_document_size = 1000 })
+            local chunk = "[" .. string.rep("1,", 100)
+
+            assert(parser:append(chunk))
+            assert(parser:append(chunk))
+            assert(parser:append("1" .. string.rep("]", 2)))
+
+            local obj = assert(parser:finish())
+            ngx.say(#obj, " ", #obj[101])
+            assert(parser:memory().body >= #chunk * 2)
+
+            -- the body is dropped once it grows too large
+            for i = 1, 4 do
+                assert(parser:append(chunk))
+            end
+
+            ngx.say(select(2, parser:append(chunk)))
+            assert(parser:append("[]"))
+            ngx.say(#parser:finish())
+
+            -- nothing appended since
+            ngx.say(select(2, parser:finish({ projection = { "b" } })))
+        }
+    }
+--- request
+GET /t
+--- response_body
+101 101
+simdjson: error: LIMIT_EXCEEDED: The document is larger than max_document_size.
+0
+simdjson: error: EMPTY: no JSON found
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: projections and pools
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local pool = simdjson.new_pool()
+            local parser = pool:checkout()
+
+            assert(parser:append([[ {"a":1,]]))
+            assert(parser:append([[ "b":2} ]]))
+
+            local obj = parser:finish({ projection = { "b" } })
+            ngx.say(obj.a, " ", obj.b)
+
+            -- a body left behind is not seen by the next user
+            assert(parser:append("[1,"))
+            pool:checkin(parser)
+
+            parser = pool:checkout()
+            assert(parser:append("[2]"))
+            ngx.say(parser:finish()[1])
+        }
+    }
+--- request
+GET /t
+--- response_body
+nil 2
+2
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,110 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: decode_ptr decodes like decode
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local ffi = require("ffi")
+            local simdjson = require("resty.simdjson")
+
+            local json = [[ {"a":[1,2,{"b":"c\né"}],"e":1.5,"f":null,"g":true} ]]
+
+            -- room for the padding, SIMDJSON_PADDING is 64
+            local buf = ffi.new("char[?]", #json + 64)
+            ffi.copy(buf, json, #json)
+
+            for _, engine in ipairs({ "ondemand", "dom", "capi", "auto" }) do
+                local parser = simdjson.new({ engine = engine })
+                local expected = parser:encode(parser:decode(json))
+
+                assert(parser:encode(parser:decode_ptr(buf, #json)) == expected)
+                assert(parser:encode(parser:decode_ptr(buf, #json, true)) == expected)
+            end
+
+            local parser = simdjson.new({ yieldable = true, batch_size = 2 })
+            local obj = parser:decode_ptr(buf, #json, true, { projection = { "g" } })
+            ngx.say(obj.a, " ", obj.g)
+
+            ngx.say(select(2, parser:decode_ptr(buf, 2, true)))
+            ngx.say(select(2, parser:decode_ptr(buf, 0, true)))
+
+            ffi.copy(buf, "1 2", 3)
+            ngx.say(select(2, parser:decode_ptr(buf, 3, true)))
+        }
+    }
+--- request
+GET /t
+--- response_body
+nil true
+simdjson: error: INCOMPLETE_ARRAY_OR_OBJECT: JSON document ended early in the middle of an object or array.
+simdjson: error: EMPTY: no JSON found
+simdjson: error: TRAILING_CONTENT: Unexpected trailing content in the JSON input.
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: decode_ptr of a string.buffer
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local buffer = require("string.buffer")
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+            local buf = buffer.new()
+
+            buf:put("[")
+            for i = 1, 1000 do
+                buf:put(i, ",")
+            end
+            buf:put("0]")
+
+            local ptr, len = buf:ref()
+            local arr = parser:decode_ptr(ptr, len)
+            ngx.say(#arr, " ", arr[1000])
+
+            -- the padding is reserved but never written
+            buf:reserve(64)
+            ptr, len = buf:ref()
+            ngx.say(#parser:decode_ptr(ptr, len, true))
+
+            assert(not pcall(parser.decode_ptr, parser, "[1]", 3))
+            assert(not pcall(parser.decode_ptr, parser, ptr, -1))
+        }
+    }
+--- request
+GET /t
+--- response_body
+1001 1000
+1001
+--- no_error_log
+[error]
+[warn]
+[crit]
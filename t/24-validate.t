@@ -0,0 +1,160 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: validate accepts what decode accepts
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new()
+
+            for _, json in ipairs({
+                [[ {"a":[1,2,{"b":"c\né"}],"e":1.5,"f":null,"g":true} ]],
+                [[ [18446744073709551615,-9223372036854775808,1e300,-0] ]],
+                [[ "str" ]],
+                "42",
+                "null",
+                -- rejected by the DOM parser
+                [[ {"id":123456789012345678901234567890} ]],
+                "-123456789012345678901234567890",
+            }) do
+                assert(parser:decode(json) ~= nil)
+                assert(parser:validate(json) == true)
+            end
+
+            for _, json in ipairs({
+                "[1 2]",
+                [[ {"a":1} x ]],
+                "[1] 2",
+                "[",
+                "",
+                "[tru]",
+                "[01]",
+                "[\"\255\"]",
+                "[123456789012345678901234567890] x",
+                "[123456789012345678901234567890,01]",
+                "[123456789012345678901234567890,\"\255\"]",
+            }) do
+                local ok, err = parser:validate(json)
+                assert(ok == nil and string.find(err, "simdjson: error: ", 1, true))
+                assert(parser:decode(json) == nil)
+            end
+
+            ngx.say(select(2, parser:validate("[\"\255\"]")))
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: UTF8_ERROR: The input is not valid UTF-8
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: validate with depth and limits
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ max_depth = 2, max_elements = 3, max_values = 8,
+                                          max_string_length = 4, max_document_size = 32 })
+
+            assert(parser:validate([[ {"abcd":[1,2,3],"b":"wxyz"} ]]))
+
+            for _, json in ipairs({
+                "[[[1]]]",
+                "[1,2,3,4]",
+                "[[1],[2],[3,4,5]]",
+                [[ {"abcde":1} ]],
+                string.rep(" ", 30) .. "[1,2]",
+            }) do
+                ngx.say(select(2, parser:validate(json)))
+            end
+
+            -- validating does not get in the way of a yieldable decode
+            parser = simdjson.new({ yieldable = true })
+            assert(parser:validate("[1]"))
+            ngx.say(parser:decode("[1,2]")[2])
+        }
+    }
+--- request
+GET /t
+--- response_body
+simdjson: error: DEPTH_ERROR: The JSON document was too deep (too many nested objects and arrays)
+simdjson: error: LIMIT_EXCEEDED: A container has more elements than max_elements.
+simdjson: error: LIMIT_EXCEEDED: The document has more values than max_values.
+simdjson: error: LIMIT_EXCEEDED: A string is longer than max_string_length.
+simdjson: error: LIMIT_EXCEEDED: The document is larger than max_document_size.
+2
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: validate while decode_many is iterating
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            -- a shrink is due on the next document
+            local parser = simdjson.new({ yieldable = true, shrink_factor = 2, shrink_baseline = 1 })
+            for _ = 1, 15 do
+                parser:decode("1")
+            end
+
+            local lines = {}
+            for i = 1, 4000 do
+                lines[i] = string.format([[{"id":%d,"name":"user %d"}]], i, i)
+            end
+
+            local iter = assert(parser:decode_many(table.concat(lines, "\n")))
+            assert(iter())
+
+            assert(parser:validate("1"))
+            assert(parser:validate("[123456789012345678901234567890]"))
+
+            local ok, err = pcall(iter)
+            assert(not ok)
+            ngx.say(err)
+        }
+    }
+--- request
+GET /t
+--- response_body
+parser was used by another decode during iteration
+--- no_error_log
+[error]
+[warn]
+[crit]
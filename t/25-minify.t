@@ -0,0 +1,101 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: minify
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            ngx.say(simdjson.minify([[
+                {
+                    "a" : [ 1, 2 ,
+                            { "b c" : "d \" e" } ],
+                    "f":	null
+                }
+            ]]))
+
+            ngx.say(simdjson.minify(""), "|", simdjson.minify(" 42 "), "|")
+
+            -- not validated
+            ngx.say(simdjson.minify("[1, 2"))
+
+            ngx.say(select(2, simdjson.minify([[ {"a": "b} ]])))
+
+            local parser = simdjson.new()
+            local big = {}
+            for i = 1, 10000 do
+                big[i] = { id = i, name = "user " .. i, tags = { "a", "b" } }
+            end
+
+            local json = parser:encode(big)
+            local pretty = string.gsub(json, "([,:%[{])", "%1\n    ")
+            assert(simdjson.minify(pretty) == json)
+
+            -- too large to keep the output buffer around
+            local huge = pretty .. string.rep(" ", 1024 * 1024)
+            assert(simdjson.minify(huge) == json)
+            assert(simdjson.minify(pretty) == json)
+        }
+    }
+--- request
+GET /t
+--- response_body
+{"a":[1,2,{"b c":"d \" e"}],"f":null}
+|42|
+[1,2
+simdjson: error: UNCLOSED_STRING: A string is opened, but never closed.
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: minify into a string.buffer
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local buffer = require("string.buffer")
+            local simdjson = require("resty.simdjson")
+
+            local buf = buffer.new()
+            buf:put("prefix ")
+
+            assert(simdjson.minify([[ [ 1 , 2 ] ]], buf) == buf)
+            assert(simdjson.minify([[ { "a" : true } ]], buf) == buf)
+
+            ngx.say(buf:tostring())
+        }
+    }
+--- request
+GET /t
+--- response_body
+prefix [1,2]{"a":true}
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,97 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: validate_utf8
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            for _, str in ipairs({
+                "",
+                "hello",
+                "caf\195\169",
+                "\226\130\172 \240\159\152\128",
+                string.rep("a\195\169", 1000),
+            }) do
+                assert(simdjson.validate_utf8(str) == true)
+            end
+
+            for _, str in ipairs({
+                "\255",
+                "caf\195",
+                "\192\128",                 -- overlong
+                "\237\160\128",             -- surrogate
+                "\244\144\128\128",         -- beyond U+10FFFF
+                string.rep("a", 1000) .. "\128",
+            }) do
+                assert(simdjson.validate_utf8(str) == false)
+            end
+
+            assert(not pcall(simdjson.validate_utf8, nil))
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: validate_utf8_ptr
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local buffer = require("string.buffer")
+            local simdjson = require("resty.simdjson")
+
+            local buf = buffer.new()
+            buf:put(string.rep("caf\195\169 ", 100))
+
+            local ptr, len = buf:ref()
+            ngx.say(simdjson.validate_utf8_ptr(ptr, len))
+
+            -- cuts a character in half
+            ngx.say(simdjson.validate_utf8_ptr(ptr, 4))
+            ngx.say(simdjson.validate_utf8_ptr(ptr, 0))
+        }
+    }
+--- request
+GET /t
+--- response_body
+true
+false
+true
+--- no_error_log
+[error]
+[warn]
+[crit]
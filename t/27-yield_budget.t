@@ -0,0 +1,155 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: batches of large strings are handed over early
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local _sleep = _G.ngx.sleep
+            ngx.ctx.yields = 0
+            _G.ngx.sleep = function()
+                ngx.ctx.yields = ngx.ctx.yields + 1
+            end
+
+            local t = {}
+            for i = 1, 100 do
+                t[i] = '"' .. string.rep("x", 100) .. '"'
+            end
+
+            local json = "[" .. table.concat(t, ",") .. "]"
+
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ yieldable = true })
+            assert(parser)
+
+            assert(#parser:decode(json) == 100)
+            ngx.say(ngx.ctx.yields)
+
+            ngx.ctx.yields = 0
+
+            parser = simdjson.new({ yieldable = true, batch_bytes = 1000 })
+            assert(parser)
+
+            local arr = parser:decode(json)
+            assert(#arr == 100)
+            assert(arr[100] == string.rep("x", 100))
+
+            _G.ngx.sleep = _sleep
+
+            ngx.say(ngx.ctx.yields >= 10)
+        }
+    }
+--- request
+GET /t
+--- response_body
+1
+true
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: yields only once the budget is used up
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local _sleep = _G.ngx.sleep
+            ngx.ctx.yields = 0
+            _G.ngx.sleep = function()
+                ngx.ctx.yields = ngx.ctx.yields + 1
+            end
+
+            local t = {}
+            for i = 1, 10000 do
+                t[i] = i
+            end
+
+            local json = "[" .. table.concat(t, ",") .. "]"
+
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ yieldable = true, batch_size = 10,
+                                          yield_budget = 1000000 })
+            assert(parser)
+
+            assert(#parser:decode(json) == 10000)
+            assert(parser:encode(t) == json)
+            ngx.say(ngx.ctx.yields)
+
+            parser = simdjson.new({ yieldable = true, batch_size = 10, yield_budget = 1 })
+            assert(parser)
+
+            assert(#parser:decode(json) == 10000)
+            assert(parser:encode(t) == json)
+
+            _G.ngx.sleep = _sleep
+
+            ngx.say(ngx.ctx.yields > 0)
+        }
+    }
+--- request
+GET /t
+--- response_body
+0
+true
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: invalid options
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            for _, bytes in ipairs({ 0, 1.5, "16" }) do
+                local ok = pcall(simdjson.new, { batch_bytes = bytes })
+                assert(not ok)
+            end
+
+            for _, budget in ipairs({ 0, 1.5, 1000001, "16" }) do
+                local ok = pcall(simdjson.new, { yield_budget = budget })
+                assert(not ok)
+            end
+
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /t
+--- response_body
+ok
+--- no_error_log
+[error]
+[warn]
+[crit]
@@ -0,0 +1,176 @@
+# vim:set ft= ts=4 sw=4 et:
+
+use Test::Nginx::Socket::Lua;
+use Cwd qw(cwd);
+
+repeat_each(2);
+
+plan tests => repeat_each() * blocks() * 5;
+
+my $pwd = cwd();
+
+our $HttpConfig = qq{
+    lua_package_path "$pwd/lib/?/init.lua;$pwd/lib/?.lua;;";
+    lua_package_cpath "$pwd/?.so;;";
+};
+
+no_long_string();
+no_diff();
+
+run_tests();
+
+__DATA__
+
+
+=== TEST 1: counters of a parser
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ batch_size = 4 })
+            assert(parser)
+
+            local stats = parser:stats()
+            assert(stats.documents == 0 and stats.batches == 0 and next(stats.errors) == nil)
+
+            local json = [[ {"a":[1,2,{"b":[null,true]}],"c":"x","d":{"c":"y"}} ]]
+            assert(parser:decode(json))
+            assert(parser:validate(json))
+
+            stats = parser:stats()
+            ngx.say(stats.documents, " ", stats.bytes == 2 * #json, " ", stats.max_depth)
+            ngx.say(stats.batches, " ", stats.yields)
+
+            local ops = stats.ops
+            ngx.say(ops.array, ops.object, ops.number, ops.string, ops.boolean, ops.null,
+                    ops.key, ops.key_id, ops["return"], ops.int64, ops.uint64, ops.error)
+        }
+    }
+--- request
+GET /t
+--- response_body
+2 true 4
+7 0
+232211415000
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 2: errors by name
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ max_string_length = 4 })
+            assert(parser)
+
+            assert(not parser:decode("[1,"))
+            assert(not parser:decode("{\"a\" 1}"))
+            assert(not parser:decode("\"too long\""))
+            assert(not parser:decode("1 2"))
+            assert(not parser:validate("[1,"))
+
+            local errors = parser:stats().errors
+            local names = {}
+            for name, n in pairs(errors) do
+                names[#names + 1] = name .. "=" .. n
+            end
+            table.sort(names)
+
+            ngx.say(table.concat(names, " "))
+        }
+    }
+--- request
+GET /t
+--- response_body
+INCOMPLETE_ARRAY_OR_OBJECT=1 LIMIT_EXCEEDED=1 TAPE_ERROR=2 TRAILING_CONTENT=1
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 3: yields and destroyed parsers
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local parser = simdjson.new({ yieldable = true, batch_size = 10 })
+            assert(parser)
+
+            local t = {}
+            for i = 1, 100 do
+                t[i] = i
+            end
+
+            assert(#parser:decode("[" .. table.concat(t, ",") .. "]") == 100)
+
+            local stats = parser:stats()
+            ngx.say(stats.yields == stats.batches - 1, " ", stats.ops.number)
+
+            -- one yield every 2048 values when encoding
+            for i = 1, 5000 do
+                t[i] = i
+            end
+
+            local yields = stats.yields
+            assert(parser:encode(t))
+            ngx.say(parser:stats().yields - yields)
+
+            parser:destroy()
+            ngx.say(select(2, pcall(parser.stats, parser)))
+        }
+    }
+--- request
+GET /t
+--- response_body
+true 100
+2
+already destroyed
+--- no_error_log
+[error]
+[warn]
+[crit]
+
+
+
+=== TEST 4: documents falling back to another engine are counted once
+--- http_config eval: $::HttpConfig
+--- config
+    location = /t {
+        content_by_lua_block {
+            local simdjson = require("resty.simdjson")
+
+            local json = [[ {"id":9007199254740993,"big":123456789012345678901234567890} ]]
+
+            for _, engine in ipairs({ "ondemand", "dom", "capi", "auto" }) do
+                local parser = simdjson.new({ engine = engine, int64 = true })
+                assert(parser:decode(json))
+                assert(parser:decode("[1]"))
+
+                local stats = parser:stats()
+                ngx.say(engine, " ", stats.documents, " ", stats.bytes == #json + 3)
+            end
+        }
+    }
+--- request
+GET /t
+--- response_body
+ondemand 2 true
+dom 2 true
+capi 2 true
+auto 2 true
+--- no_error_log
+[error]
+[warn]
+[crit]